@@ -2,13 +2,51 @@
 """
 KSU Benchmark Runner
 
-This script compiles and runs all .ksu files under benchmark/examples.
-It measures timings for:
+This script compiles and runs all .ksu files under benchmark/examples and the
+microbenchmarks under benchmark/micro (allocation, closure and call/cc heavy
+loops). Every phase is timed separately:
 - ksu code generation
-- C compilation
+- C compilation (against the prebuilt libksu.a)
 - program execution
 
-Outputs a simple table per file.
+Each phase runs --warmup times unmeasured and then --runs times. The table
+shows the median of the runs and, for the run phase, a distribution-free 95%
+confidence interval of the median. Peak RSS is the largest one seen. With
+--cpus the benchmarks are pinned to the given CPUs, which keeps the scheduler
+from moving them around between runs.
+
+If the runtime prints counters (lines of the form `ksu-stats: name=value` on
+stderr), they are collected as well; --stats builds every program with
+`ksu build -O3 --stats` and runs it with KSU_STATS=1, which prints them.
+
+With --json [PATH] the results are also written as JSON, by default to
+benchmark/results/<commit>.json. --compare OLD NEW reads two such files and
+flags every phase whose median got more than --threshold percent slower with
+confidence intervals that do not overlap. It exits with 1 if anything
+regressed.
+
+With --compare-malloc every program is additionally built with
+-DKSU_SYSTEM_MALLOC (plain malloc per object instead of the runtime's
+size-class chunk allocator) and the two runs are shown side by side.
+
+With --compare-cheney every program is additionally built with -DKSU_CHENEY
+(direct C calls with longjmp stack resets instead of a trampoline bounce per
+call) and compared against the default trampoline build.
+
+With --compare-lto every program is built by `ksu build -O3 --lto`, which
+lets gcc inline libksu.a into the program, and compared against plain
+`ksu build -O3`. --compare-pgo compares `ksu build -O3 --lto --pgo` against
+`ksu build -O3 --lto`; the training run is the benchmark itself.
+
+With --compile-scaling only code generation is measured, on synthetic
+programs of 1k to 100k definitions. The time per definition should stay flat:
+every compiler pass is meant to be linear in the size of the program.
+
+With --throughput [MB] the programs under benchmark/throughput run on a
+generated input file of that many megabytes (default 300), one number per line,
+fed as stdin. The table shows the input processed per second. With
+--compare-pgo as well, each program is built with `--lto --pgo`, trained on
+that input, and with `--lto`.
 """
 
 import subprocess
@@ -16,10 +54,30 @@ import time
 from pathlib import Path
 import tempfile
 import sys
+import os
+import re
+import json
+import math
+import random
+import statistics
+import argparse
 from datetime import datetime
 
 ROOT = Path(__file__).resolve().parent.parent
-EXAMPLES_DIR = ROOT / 'benchmark' / 'examples'
+SUITES = {
+    'examples': ROOT / 'benchmark' / 'examples',
+    'micro': ROOT / 'benchmark' / 'micro',
+}
+RESULTS_DIR = ROOT / 'benchmark' / 'results'
+SCALING_SIZES = [1000, 10000, 100000]
+THROUGHPUT_DIR = ROOT / 'benchmark' / 'throughput'
+KSU_BIN = ROOT / '_build' / 'default' / 'src' / 'ksu.exe'
+RUNTIME_DIR = ROOT / 'src' / 'Runtime'
+LIBKSU = ROOT / '_build' / 'default' / 'src' / 'Runtime' / 'libksu.a'
+RUNTIME_SOURCES = [RUNTIME_DIR / 'ksu_runtime.c', RUNTIME_DIR / 'ksu_builtins.c']
+PHASES = ['gen', 'compile', 'run']
+STATS_LINE = re.compile(r'^ksu-stats: (\w+)=(\d+)$', re.MULTILINE)
+CONFIDENCE = 0.95
 
 
 def run_command(cmd, cwd=None, input_text=None):
@@ -35,6 +93,24 @@ def run_command(cmd, cwd=None, input_text=None):
     return proc, end - start
 
 
+def run_program(exe_path, stdin_path=os.devnull, output_tail=None):
+    # Like run_command, but also returns the peak RSS of the program in kB.
+    # Output goes to temporary files so that the child can be reaped with
+    # wait4, which reports its resource usage. With output_tail only the last
+    # that many bytes of the output are kept.
+    with tempfile.TemporaryFile() as out, tempfile.TemporaryFile() as err, open(stdin_path, 'rb') as inp:
+        start = time.perf_counter()
+        proc = subprocess.Popen([str(exe_path)], stdin=inp, stdout=out, stderr=err)
+        _, status, usage = os.wait4(proc.pid, 0)
+        end = time.perf_counter()
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        out.seek(0 if output_tail is None else max(0, out.tell() - output_tail))
+        err.seek(0)
+        result = subprocess.CompletedProcess(proc.args, proc.returncode,
+                                             out.read().decode(), err.read().decode())
+    return result, end - start, usage.ru_maxrss
+
+
 def get_commit_id():
     try:
         proc = subprocess.run(['git', 'rev-parse', 'HEAD'], cwd=ROOT, capture_output=True, text=True)
@@ -43,23 +119,85 @@ def get_commit_id():
         return 'unknown'
 
 
-def benchmark_file(file_path: Path):
+def median_ci(samples, confidence=CONFIDENCE):
+    # Distribution-free confidence interval of the median: [x_r, x_(n+1-r)]
+    # of the sorted samples covers it with probability 1 - 2 P(B < r), where
+    # B ~ Binomial(n, 1/2). Picks the narrowest such interval; with fewer than
+    # six samples even (min, max) falls short of 95%, so that is returned.
+    xs = sorted(samples)
+    n = len(xs)
+    below = lambda r: sum(math.comb(n, i) for i in range(r)) / 2 ** n
+    r = 1
+    while r + 1 <= n // 2 and 1 - 2 * below(r + 1) >= confidence:
+        r += 1
+    return xs[r - 1], xs[n - r]
+
+
+def summarize(samples):
+    low, high = median_ci(samples)
+    return {
+        'median': statistics.median(samples),
+        'mean': statistics.mean(samples),
+        'stdev': statistics.stdev(samples) if len(samples) > 1 else 0.0,
+        'ci_low': low,
+        'ci_high': high,
+        'samples': samples,
+    }
+
+
+def repeat(measure, runs, warmup):
+    # Calls measure() warmup times, then runs times; returns the last process
+    # and the timings of the measured calls. Stops at the first failure.
+    times = []
+    for i in range(warmup + runs):
+        proc, elapsed = measure()
+        if proc.returncode != 0:
+            return proc, times
+        if i >= warmup:
+            times.append(elapsed)
+    return proc, times
+
+
+def gcc_build(cflags=(), runtime=(LIBKSU,)):
+    # Compiles the generated C with gcc -O3 and links it with the runtime:
+    # libksu.a, or its sources when cflags change how the runtime is built
+    def command(ksu_path, c_path, exe_path, input_path=os.devnull):
+        return ['gcc', str(c_path), *map(str, runtime), '-I', str(RUNTIME_DIR), '-O3', '-pthread', *cflags,
+                '-o', str(exe_path)]
+    return command
+
+
+def ksu_build(*flags):
+    # Leaves the whole build to the ksu build driver. A --pgo build trains on
+    # the input the benchmark runs on.
+    def command(ksu_path, c_path, exe_path, input_path=os.devnull):
+        training = ['--pgo-input', str(input_path)] if '--pgo' in flags else []
+        return [str(KSU_BIN), 'build', *flags, *training, '-o', str(exe_path), str(ksu_path)]
+    return command
+
+
+def benchmark_file(file_path: Path, build=gcc_build(), runs=5, warmup=1):
+    result = {
+        'name': file_path.name,
+        'status': 'OK',
+        'gen': None,
+        'compile': None,
+        'run': None,
+        'c_size_bytes': None,
+        'exe_size_bytes': None,
+        'rss_kb': None,
+        'counters': {},
+        'stderr': '',
+    }
+
     # 1) Generate C from ksu
-    gen_proc, gen_time = run_command(['dune', 'exec', 'ksu', '--', str(file_path)], cwd=ROOT)
+    gen_proc, gen_times = repeat(lambda: run_command([str(KSU_BIN), str(file_path)], cwd=ROOT), runs, warmup)
     if gen_proc.returncode != 0:
-        return {
-            'name': file_path.name,
-            'status': 'GEN_ERROR',
-            'gen_time_s': gen_time,
-            'compile_time_s': None,
-            'run_time_s': None,
-            'c_size_bytes': None,
-            'exe_size_bytes': None,
-            'resindent_set_kb': None,
-            'stderr': gen_proc.stderr.strip(),
-        }
+        result.update(status='GEN_ERROR', stderr=gen_proc.stderr.strip())
+        return result
+    result['gen'] = summarize(gen_times)
     c_code = gen_proc.stdout
-    c_size = len(c_code.encode('utf-8'))
+    result['c_size_bytes'] = len(c_code.encode('utf-8'))
 
     # 2) Compile and 3) Run
     with tempfile.TemporaryDirectory() as td:
@@ -67,71 +205,318 @@ def benchmark_file(file_path: Path):
         exe_path = Path(td) / 'a.out'
         c_path.write_text(c_code)
 
-        runtime_path = ROOT / 'src' / 'Runtime' / 'ksu_runtime.c'
-        runtime_include = str(ROOT / 'src' / 'Runtime')
-        comp_proc, comp_time = run_command(['gcc', str(c_path), str(runtime_path), '-I', runtime_include, '-O3', '-o', str(exe_path)])
+        compile_cmd = build(file_path, c_path, exe_path)
+        comp_proc, comp_times = repeat(lambda: run_command(compile_cmd, cwd=ROOT), runs, warmup)
         if comp_proc.returncode != 0:
-            return {
-                'name': file_path.name,
-                'status': 'COMPILE_ERROR',
-                'gen_time_s': gen_time,
-                'compile_time_s': comp_time,
-                'run_time_s': None,
-                'c_size_bytes': c_size,
-                'exe_size_bytes': None,
-                'resindent_set_kb': None,
-                'stderr': comp_proc.stderr.strip(),
-            }
-
-        exe_size = exe_path.stat().st_size
-
-        run_proc, run_time = run_command(['/usr/bin/time', '-f', '%M', str(exe_path)])
-        status = 'OK' if run_proc.returncode == 0 else f'RUN_ERROR({run_proc.returncode})'
-
-        # /usr/bin/time outputs to stderr
-        rss_kb = int(run_proc.stderr.strip()) if run_proc.stderr.strip().isdigit() else 0
-
-        return {
-            'name': file_path.name,
-            'status': status,
-            'gen_time_s': gen_time,
-            'compile_time_s': comp_time,
-            'run_time_s': run_time,
-            'c_size_bytes': c_size,
-            'exe_size_bytes': exe_size,
-            'resindent_set_kb': rss_kb,
-            'stderr': run_proc.stderr.strip(),
-        }
+            result.update(status='COMPILE_ERROR', stderr=comp_proc.stderr.strip())
+            return result
+        result['compile'] = summarize(comp_times)
+        result['exe_size_bytes'] = exe_path.stat().st_size
+
+        peak_rss = [0]
+
+        def measure_run():
+            proc, elapsed, rss_kb = run_program(exe_path)
+            peak_rss[0] = max(peak_rss[0], rss_kb)
+            return proc, elapsed
+
+        run_proc, run_times = repeat(measure_run, runs, warmup)
+        result['stderr'] = run_proc.stderr.strip()
+        result['counters'] = {k: int(v) for k, v in STATS_LINE.findall(run_proc.stderr)}
+        if run_proc.returncode != 0:
+            result['status'] = f'RUN_ERROR({run_proc.returncode})'
+            return result
+        result['run'] = summarize(run_times)
+        result['rss_kb'] = peak_rss[0]
+        return result
+
+
+def compare_builds(files, base_label, base_build, other_label, other_build, runs, warmup):
+    # speedup is how much faster the base build runs than the other one
+    print("-" * 86)
+    print(f"{'file':20} {base_label + ' run(s)':>13} {base_label + ' rss kb':>13} "
+          f"{other_label + ' run(s)':>14} {other_label + ' rss kb':>14} {'speedup':>8}")
+    print("-" * 86)
+
+    exit_code = 0
+    for f in files:
+        base = benchmark_file(f, base_build, runs, warmup)
+        other = benchmark_file(f, other_build, runs, warmup)
+        if base['status'] != 'OK' or other['status'] != 'OK':
+            exit_code = 1
+            print(f"{f.name:20} {base['status']:>13} {'':>13} {other['status']:>14}")
+            continue
+        base_run = base['run']['median']
+        other_run = other['run']['median']
+        speedup = other_run / base_run if base_run else 0.0
+        print(f"{f.name:20} {base_run:>13.4f} {base['rss_kb']:>13} "
+              f"{other_run:>14.4f} {other['rss_kb']:>14} {speedup:>7.2f}x")
+
+    print("-" * 86)
+    return exit_code
+
+
+def compare_results(old_path, new_path, threshold):
+    # A phase regressed if its median grew by more than threshold percent and
+    # the confidence intervals of the two medians do not overlap
+    old = json.loads(Path(old_path).read_text())
+    new = json.loads(Path(new_path).read_text())
+    print(f"Comparing {old['commit']} ({old['date']}) -> {new['commit']} ({new['date']})")
+    print("-" * 84)
+    print(f"{'file':20} {'phase':>8} {'old(s)':>10} {'new(s)':>10} {'change':>9}  {'verdict'}")
+    print("-" * 84)
+
+    regressions = 0
+    for name, new_res in sorted(new['results'].items()):
+        old_res = old['results'].get(name)
+        if old_res is None:
+            print(f"{name:20} {'':>8} {'':>10} {'':>10} {'':>9}  new benchmark")
+            continue
+        if new_res['status'] != 'OK' or old_res['status'] != 'OK':
+            print(f"{name:20} {'':>8} {old_res['status']:>10} {new_res['status']:>10}")
+            if old_res['status'] == 'OK':
+                regressions += 1
+            continue
+        for phase in PHASES:
+            o, n = old_res[phase], new_res[phase]
+            change = (n['median'] / o['median'] - 1) * 100 if o['median'] else 0.0
+            verdict = ''
+            if change > threshold and n['ci_low'] > o['ci_high']:
+                verdict = 'REGRESSION'
+                regressions += 1
+            elif change < -threshold and n['ci_high'] < o['ci_low']:
+                verdict = 'improvement'
+            print(f"{name:20} {phase:>8} {o['median']:>10.4f} {n['median']:>10.4f} {change:>+8.1f}%  {verdict}")
+        for counter in sorted(set(old_res['counters']) | set(new_res['counters'])):
+            o, n = old_res['counters'].get(counter), new_res['counters'].get(counter)
+            if o != n:
+                print(f"{name:20} {counter:>8} {str(o):>10} {str(n):>10}")
+
+    print("-" * 84)
+    print(f"{regressions} regression(s) above {threshold}%")
+    return 1 if regressions else 0
+
+
+def synthetic_program(n):
+    # Each function captures its argument in a closure, branches and calls the
+    # previous one, so every pass has some work to do per definition
+    lines = ["(define (f0 x) (+ x 1))"]
+    for i in range(1, n):
+        lines.append(f"(define (f{i} x) (let ([g (lambda (y) (+ x y))]) "
+                     f"(if (< x {i}) (g (f{i - 1} x)) (g {i}))))")
+    lines.append(f"(print (f{n - 1} 0))")
+    return "\n".join(lines) + "\n"
+
+
+def compile_scaling():
+    print("-" * 50)
+    print(f"{'definitions':>12} {'gen(s)':>10} {'us/def':>10} {'.c size':>14}")
+    print("-" * 50)
+
+    per_def = []
+    with tempfile.TemporaryDirectory() as td:
+        for n in SCALING_SIZES:
+            path = Path(td) / f'scaling-{n}.ksu'
+            path.write_text(synthetic_program(n))
+            gen_proc, gen_time = run_command([str(KSU_BIN), str(path)], cwd=ROOT)
+            if gen_proc.returncode != 0:
+                print(f"{n:>12} {'GEN_ERROR':>10}")
+                print(gen_proc.stderr.strip())
+                return 1
+            per_def.append(gen_time / n)
+            print(f"{n:>12} {gen_time:>10.4f} {gen_time / n * 1e6:>10.2f} {len(gen_proc.stdout):>14}")
+
+    print("-" * 50)
+    print(f"time per definition changed {per_def[-1] / per_def[0]:.2f}x "
+          f"from {SCALING_SIZES[0]} to {SCALING_SIZES[-1]} definitions")
+    return 0
+
+
+def throughput_input(path, megabytes):
+    # Writes numbers from 0 to 999999, one per line, until the file has the
+    # given size; returns their sum modulo 1000000 and their count
+    rng = random.Random(42)
+    size, total, count = megabytes * 1024 * 1024, 0, 0
+    with open(path, 'w') as f:
+        while f.tell() < size:
+            block = [rng.randrange(1000000) for _ in range(100000)]
+            total += sum(block)
+            count += len(block)
+            f.write('\n'.join(map(str, block)) + '\n')
+    return total % 1000000, count
+
+
+def throughput(megabytes, runs, warmup, builds=(('gcc', gcc_build()),)):
+    files = sorted(THROUGHPUT_DIR.glob('*.ksu'))
+    with tempfile.TemporaryDirectory() as td:
+        input_path = Path(td) / 'input.txt'
+        total, count = throughput_input(input_path, megabytes)
+        size_mb = input_path.stat().st_size / (1024 * 1024)
+        print(f"Input: {size_mb:.0f} MB, {count} numbers")
+        print("-" * 90)
+        print(f"{'file':36} {'run(s)':>9} {'run 95% CI':>17} {'MB/s':>9} {'rss kb':>9} {'status':>6}")
+        print("-" * 90)
+
+        exit_code = 0
+        for file_path, (label, build) in ((f, b) for f in files for b in builds):
+            name = file_path.name if len(builds) == 1 else f"{file_path.name} ({label})"
+            c_path, exe_path = Path(td) / 'bench.c', Path(td) / 'a.out'
+            gen_proc, _ = run_command([str(KSU_BIN), str(file_path)], cwd=ROOT)
+            status = 'OK'
+            if gen_proc.returncode != 0:
+                status = 'GEN_ERROR'
+            else:
+                c_path.write_text(gen_proc.stdout)
+                comp_proc, _ = run_command(build(file_path, c_path, exe_path, input_path), cwd=ROOT)
+                if comp_proc.returncode != 0:
+                    status = 'COMPILE_ERROR'
+            if status != 'OK':
+                print(f"{name:36} {'-':>9} {'-':>17} {'-':>9} {'-':>9} {status:>6}")
+                exit_code = 1
+                continue
+
+            peak_rss = [0]
+
+            def measure_run():
+                proc, elapsed, rss_kb = run_program(exe_path, input_path, output_tail=64)
+                peak_rss[0] = max(peak_rss[0], rss_kb)
+                return proc, elapsed
+
+            run_proc, run_times = repeat(measure_run, runs, warmup)
+            # The last line printed is the count of numbers or lines read
+            lines = run_proc.stdout.rsplit('\n', 2)
+            if run_proc.returncode != 0:
+                status = f'RUN_ERROR({run_proc.returncode})'
+            elif lines[-2] != str(count) or ('numbers' in file_path.name and lines[-3] != str(total)):
+                status = 'WRONG'
+            if status != 'OK':
+                exit_code = 1
+            run = summarize(run_times)
+            ci = f"{run['ci_low']:.4f}-{run['ci_high']:.4f}"
+            print(f"{name:36} {run['median']:>9.4f} {ci:>17} "
+                  f"{size_mb / run['median']:>9.1f} {peak_rss[0]:>9} {status:>6}")
+        print("-" * 90)
+    return exit_code
 
 
 def main():
-    files = sorted(EXAMPLES_DIR.glob('*.ksu'))
+    parser = argparse.ArgumentParser(description='Benchmark ksu programs under benchmark/examples and benchmark/micro')
+    parser.add_argument('--suite', choices=['all', *SUITES], default='all',
+                        help='which benchmarks to run (default: all)')
+    parser.add_argument('--runs', type=int, default=5, help='measured runs per phase (default: 5)')
+    parser.add_argument('--warmup', type=int, default=1, help='unmeasured runs per phase first (default: 1)')
+    parser.add_argument('--cpus', help='pin the benchmarks to these CPUs, e.g. 2 or 2,3')
+    parser.add_argument('--stats', action='store_true',
+                        help='build with ksu build --stats and collect the runtime counters')
+    parser.add_argument('--json', nargs='?', const='', metavar='PATH',
+                        help='also write the results as JSON (default: benchmark/results/<commit>.json)')
+    parser.add_argument('--compare', nargs=2, metavar=('OLD', 'NEW'),
+                        help='compare two JSON result files and flag regressions')
+    parser.add_argument('--threshold', type=float, default=5.0,
+                        help='slowdown in percent that --compare reports as a regression (default: 5)')
+    parser.add_argument('--compare-malloc', action='store_true',
+                        help='also build with -DKSU_SYSTEM_MALLOC and compare against the chunk allocator')
+    parser.add_argument('--compare-cheney', action='store_true',
+                        help='also build with -DKSU_CHENEY and compare against the trampoline')
+    parser.add_argument('--compare-lto', action='store_true',
+                        help='compare ksu build -O3 --lto against ksu build -O3')
+    parser.add_argument('--compare-pgo', action='store_true',
+                        help='compare ksu build -O3 --lto --pgo against ksu build -O3 --lto')
+    parser.add_argument('--compile-scaling', action='store_true',
+                        help='measure code generation on synthetic programs of growing size')
+    parser.add_argument('--throughput', nargs='?', type=int, const=300, metavar='MB',
+                        help='run benchmark/throughput on a generated input of MB megabytes (default: 300)')
+    args = parser.parse_args()
+
+    if args.compare:
+        return compare_results(*args.compare, args.threshold)
+    if args.runs < 1 or args.warmup < 0:
+        parser.error('--runs must be at least 1 and --warmup not negative')
+
+    build = subprocess.run(['dune', 'build'], cwd=ROOT, capture_output=True, text=True)
+    if build.returncode != 0:
+        print(f"Build failed: {build.stderr}")
+        return 1
+
+    if args.compile_scaling:
+        return compile_scaling()
+
+    # Children inherit the affinity of this process
+    cpus = sorted(int(c) for c in args.cpus.split(',')) if args.cpus else None
+    if cpus:
+        os.sched_setaffinity(0, cpus)
+    if args.throughput and args.compare_pgo:
+        return throughput(args.throughput, args.runs, args.warmup,
+                          [('pgo', ksu_build('-O3', '--lto', '--pgo')), ('lto', ksu_build('-O3', '--lto'))])
+    if args.throughput:
+        return throughput(args.throughput, args.runs, args.warmup)
+
+    suites = SUITES.values() if args.suite == 'all' else [SUITES[args.suite]]
+    files = [f for d in suites for f in sorted(d.glob('*.ksu'))]
     if not files:
-        print(f"No .ksu files found in {EXAMPLES_DIR}")
+        print(f"No .ksu files found in {', '.join(str(d) for d in suites)}")
         return 1
 
     timestamp = datetime.now().strftime('%Y-%m-%d %H:%M:%S')
     commit_id = get_commit_id()
-    print(f"Benchmarking {len(files)} file(s) in {EXAMPLES_DIR}")
+    print(f"Benchmarking {len(files)} file(s), {args.runs} run(s) after {args.warmup} warmup(s)"
+          + (f", pinned to CPUs {args.cpus}" if cpus else ""))
     print(f"Date: {timestamp} | Commit: {commit_id}")
-    print("-" * 102)
-    print(f"{'file':20} {'gen(s)':>10} {'compile(s)':>10} {'run(s)':>10} {'rss kb':>10} {'.c size':>12} {'binary':>12} {'status':>12}")
-    print("-" * 102)
+    if args.compare_malloc:
+        return compare_builds(files, 'chunk', gcc_build(runtime=RUNTIME_SOURCES),
+                              'malloc', gcc_build(['-DKSU_SYSTEM_MALLOC'], RUNTIME_SOURCES),
+                              args.runs, args.warmup)
+    if args.compare_cheney:
+        return compare_builds(files, 'cheney', gcc_build(['-DKSU_CHENEY']), 'tramp', gcc_build(),
+                              args.runs, args.warmup)
+    if args.compare_lto:
+        return compare_builds(files, 'lto', ksu_build('-O3', '--lto'), 'o3', ksu_build('-O3'),
+                              args.runs, args.warmup)
+    if args.compare_pgo:
+        return compare_builds(files, 'pgo', ksu_build('-O3', '--lto', '--pgo'), 'lto', ksu_build('-O3', '--lto'),
+                              args.runs, args.warmup)
+
+    build_cmd = gcc_build()
+    if args.stats:
+        build_cmd = ksu_build('-O3', '--stats')
+        os.environ['KSU_STATS'] = '1'
+    print("-" * 118)
+    print(f"{'file':20} {'gen(s)':>9} {'compile(s)':>10} {'run(s)':>9} {'run 95% CI':>17} "
+          f"{'rss kb':>9} {'.c size':>10} {'binary':>10} {'status':>14}")
+    print("-" * 118)
 
     exit_code = 0
+    results = {}
     for f in files:
-        res = benchmark_file(f)
+        res = benchmark_file(f, build_cmd, args.runs, args.warmup)
+        results[res['name']] = res
         if res['status'] != 'OK':
             exit_code = 1
-        gt = f"{res['gen_time_s']:.4f}" if res['gen_time_s'] is not None else '-'
-        ct = f"{res['compile_time_s']:.4f}" if res['compile_time_s'] is not None else '-'
-        rt = f"{res['run_time_s']:.4f}" if res['run_time_s'] is not None else '-'
-        rs = f"{res['resindent_set_kb']}" if res['resindent_set_kb'] is not None else '-'
+        med = lambda phase: f"{res[phase]['median']:.4f}" if res[phase] else '-'
+        ci = f"{res['run']['ci_low']:.4f}-{res['run']['ci_high']:.4f}" if res['run'] else '-'
+        rs = f"{res['rss_kb']}" if res['rss_kb'] is not None else '-'
         cs = f"{res['c_size_bytes']}" if res['c_size_bytes'] is not None else '-'
         es = f"{res['exe_size_bytes']}" if res['exe_size_bytes'] is not None else '-'
-        print(f"{res['name']:20} {gt:>10} {ct:>10} {rt:>10} {rs:>10} {cs:>12} {es:>12} {res['status']:>12}")
+        print(f"{res['name']:20} {med('gen'):>9} {med('compile'):>10} {med('run'):>9} {ci:>17} "
+              f"{rs:>9} {cs:>10} {es:>10} {res['status']:>14}")
+        if res['counters']:
+            print(' ' * 21 + '  '.join(f"{k}={v}" for k, v in res['counters'].items()))
+
+    print("-" * 118)
 
-    print("-" * 112)
+    if args.json is not None:
+        path = Path(args.json) if args.json else RESULTS_DIR / f'{commit_id}.json'
+        path.parent.mkdir(parents=True, exist_ok=True)
+        path.write_text(json.dumps({
+            'commit': commit_id,
+            'date': timestamp,
+            'runs': args.runs,
+            'warmup': args.warmup,
+            'cpus': cpus,
+            'build': 'stats' if args.stats else 'libksu.a',
+            'results': results,
+        }, indent=2) + '\n')
+        print(f"Results written to {path}")
     return exit_code
 
 
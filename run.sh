@@ -24,8 +24,8 @@ echo "  AST:     /tmp/$(basename "$INPUT").ast"
 echo "  CC-AST:  /tmp/$(basename "$INPUT").cc.ast"
 echo "  C:       $CFILE"
 
-echo "==> Compiling C code with gcc..."
-gcc -o "$EXEC" "$CFILE" src/Runtime/ksu_runtime.c -I src/Runtime
+echo "==> Building $EXEC against libksu.a..."
+dune exec ksu -- build -O2 -o "$EXEC" "$INPUT"
 
 echo "==> Running $EXEC..."
 echo "--- OUTPUT ---"
@@ -2,7 +2,7 @@ open Lang
 open Ast
 
 type cc_top_expr =
-  | CC_FuncDef of var * var list * cc_expr 
+  | CC_FuncDef of var * var list * cc_expr * convention * func_source
   | CC_VarDef of var * cc_expr
   | CC_Expr of cc_expr
 
@@ -11,8 +11,12 @@ and cc_expr =
   | CC_MakeClosure of
       var * cc_expr (* function id, environment - (cc_expr must be the Env) *)
   | CC_MakeEnv of (var * cc_expr) list (* env variables*)
-  | CC_EnvRef of var * var (* env id (i.e. $e_123) and id of the argument. *)
+  | CC_EnvRef of var * int * var (* env id (i.e. $env), slot index and name of the variable (debug only) *)
   | CC_App of cc_expr * cc_expr list (* May be application of closure or prim *)
+  | CC_KnownApp of var * cc_expr list (* direct call of a known top-level function by its id *)
+  (* Calls in direct-style code, which evaluate to the result *)
+  | CC_DirectApp of cc_expr * cc_expr list (* call of a closure *)
+  | CC_DirectKnownApp of var * cc_expr list (* call of a known direct-style function *)
   (* Literals *)
   | CC_Lit of Ast.lit
   (* Non-literals *)
@@ -20,8 +24,22 @@ and cc_expr =
   | CC_If of cc_expr * cc_expr * cc_expr
   | CC_Callcc of var * cc_expr
   | CC_Prim of prim
+  (* Open-coded primitives *)
+  | CC_PrimOp of prim * cc_expr list (* direct-style primitive call, evaluates to a value *)
+  | CC_Let of var * cc_expr * cc_expr (* binds a value, then continues with the body *)
+  (* Self tail calls *)
+  | CC_Loop of cc_expr (* function body that is restarted by CC_Recur *)
+  | CC_Recur of (var * cc_expr) list (* assigns new values to the parameters and restarts the loop *)
+
+(* Where the code of a function comes from, for the source map of the generated C *)
+and func_source = {
+  define : var option; (* define the code is written in, None in top-level expressions *)
+  origin : origin;
+  own : bool; (* the function is the lambda of the define itself *)
+}
 
 module VarSet = Set.Make (String)
+module VarMap = Map.Make (String)
 
 (* Obtains set of free variables in an expression *)
 let rec free : expr -> VarSet.t =
@@ -30,7 +48,7 @@ let rec free : expr -> VarSet.t =
   (* Trivial Stuff *)
   | E_Lit _ | E_Prim _ -> VarSet.empty
   (* A bit less trivial *)
-  | E_App (f, args) ->
+  | E_App (f, args, _) ->
       List.fold_left
         (fun free_vars expr -> VarSet.union free_vars (free expr))
         VarSet.empty (f :: args)
@@ -38,7 +56,21 @@ let rec free : expr -> VarSet.t =
   | E_Callcc (v, expr) -> VarSet.diff (free expr) (VarSet.singleton v)
   | E_If (c, y, n) -> VarSet.union (free n) @@ VarSet.union (free c) (free y)
   (* Lambda *)
-  | E_Lambda (args, body) -> VarSet.diff (free body) (VarSet.of_list args)
+  | E_Lambda (args, body, _, _) -> VarSet.diff (free body) (VarSet.of_list args)
+
+(* Renames the free variables of an expression; the new names must be fresh *)
+let rec rename_free (renames : var VarMap.t) (expr : expr) : expr =
+  if VarMap.is_empty renames then expr
+  else
+    let r = rename_free renames in
+    let under vars = rename_free (List.fold_left (fun acc v -> VarMap.remove v acc) renames vars) in
+    match expr with
+    | E_Lit _ | E_Prim _ -> expr
+    | E_Var v -> E_Var (Option.value (VarMap.find_opt v renames) ~default:v)
+    | E_App (f, args, line) -> E_App (r f, List.map r args, line)
+    | E_If (c, y, n) -> E_If (r c, r y, r n)
+    | E_Callcc (v, body) -> E_Callcc (v, under [ v ] body)
+    | E_Lambda (args, body, origin, convention) -> E_Lambda (args, under args body, origin, convention)
 
 (* Converts expression to the closure-converted. As all functions become global at this step, we also return list of FuncDefs *)
 let convert : top_expr list -> cc_top_expr list =
@@ -50,18 +82,95 @@ let convert : top_expr list -> cc_top_expr list =
   in
   let gen_lambda_id = gen_fresh_var "Lambda" in
 
+  (* Converted definitions, most recent first *)
   let res = ref [] in
-  let append t = res := !res @ [ t ] in
+  let append t = res := t :: !res in
+  (* Define whose code is being converted: the owner of the innermost source lambda,
+     which continuations inherit *)
+  let current_define = ref None in
+
+  (* Known functions: top-level names that are defined exactly once, as a lambda, mapped to
+     their function id, arity and convention. After CPS such a define reads (id (lambda ...)),
+     and the arity does not count the continuation of CPS lambdas. *)
+  let known = ref VarMap.empty in
+  (* Known functions that just apply a primitive to their arguments, like the builtin
+     definitions of + or fst. Calls of those are replaced by the primitive itself. *)
+  let prim_wrappers = ref VarMap.empty in
+  let find_known_functions (exprs : top_expr list) =
+    let counts =
+      List.fold_left
+        (fun acc -> function
+          | E_Define (v, _) -> VarMap.update v (fun c -> Some (1 + Option.value c ~default:0)) acc
+          | E_Expr _ -> acc)
+        VarMap.empty exprs
+    in
+    List.iter
+      (function
+        | E_Define (v, E_App (E_Var "id", [ E_Lambda (args, body, _, convention) ], _))
+          when VarMap.find v counts = 1 -> (
+            let arity = match convention with C_Cps -> List.length args - 1 | C_Direct -> List.length args in
+            known := VarMap.add v (gen_lambda_id (), arity, convention) !known;
+            match body with
+            | E_App (E_Prim p, prim_args, _) when prim_args = List.map (fun a -> E_Var a) args ->
+                prim_wrappers := VarMap.add v p !prim_wrappers
+            | _ -> ())
+        | _ -> ())
+      exprs
+  in
+  let is_known_call (bound : VarSet.t) (f : var) (argc : int) : bool =
+    match VarMap.find_opt f !known with
+    | Some (_, arity, _) -> arity = argc && not (VarSet.mem f bound)
+    | None -> false
+  in
+  let known_id f =
+    let id, _, _ = VarMap.find f !known in
+    id
+  in
 
   (* Auxillary function, checks if var is captured by closure  *)
-  let cc_expr_of_var (sub : VarSet.t) (env_sym : var) (v : var) : cc_expr =
-    if VarSet.mem v sub then CC_EnvRef (env_sym, v) else CC_Var v
+  let cc_expr_of_var (slots : int VarMap.t) (env_sym : var) (v : var) : cc_expr =
+    match VarMap.find_opt v slots with
+    | Some slot -> CC_EnvRef (env_sym, slot, v)
+    | None -> CC_Var v
+  in
+
+  (* Let-bound variables live until their function returns (in CPS code, a self tail call
+     that Loops turns into a jump must not find a parameter shadowed), so each one gets a
+     name of its own *)
+  let fresh_local =
+    let num = ref 0 in
+    fun v ->
+      num := !num + 1;
+      v ^ "$" ^ string_of_int !num
+  in
+  let direct_var slots env_sym renames v =
+    match VarMap.find_opt v renames with Some v' -> CC_Var v' | None -> cc_expr_of_var slots env_sym v
+  in
+  (* A let whose body just returns the variable, like the last expression of a begin, is
+     the bound expression itself, which keeps calls in tail position *)
+  let direct_let x e body = match body with CC_Var y when y = x -> e | _ -> CC_Let (x, e, body) in
+  (* C leaves the order of evaluation of arguments open, and a collection in one argument
+     would not see the values of the others. So arguments other than atoms are bound to
+     variables first, left to right, except the last one. *)
+  let direct_args (args : cc_expr list) (k : cc_expr list -> cc_expr) : cc_expr =
+    let is_atom = function CC_Var _ | CC_EnvRef _ -> true | CC_Lit (L_String _) -> false | CC_Lit _ -> true | _ -> false in
+    let last = snd (List.fold_left (fun (i, last) a -> (i + 1, if is_atom a then last else i)) (0, -1) args) in
+    let rec go i args acc =
+      match args with
+      | [] -> k (List.rev acc)
+      | a :: rest when is_atom a || i = last -> go (i + 1) rest (a :: acc)
+      | a :: rest ->
+          let x = fresh_local "tmp" in
+          CC_Let (x, a, go (i + 1) rest (CC_Var x :: acc))
+    in
+    go 0 args []
   in
 
-  let rec t : VarSet.t -> var -> expr -> cc_expr =
-    (* Sub is set of variables that should be taken from the captured env via EnvRef *)
-   fun sub env_sym expr ->
-    let t' = t sub env_sym in
+  let rec t : VarSet.t -> int VarMap.t -> var -> expr -> cc_expr =
+    (* Bound is set of lexically bound variables in scope - everything else is a global.
+       Slots maps variables that should be taken from the captured env via EnvRef to their index *)
+   fun bound slots env_sym expr ->
+    let t' = t bound slots env_sym in
 
     match expr with
     (* Trivial Stuff *)
@@ -69,72 +178,172 @@ let convert : top_expr list -> cc_top_expr list =
     | E_Prim p -> CC_Prim p
     (* A bit trickier *)
     | E_If (c, y, n) -> CC_If (t' c, t' y, t' n)
-    | E_Callcc (v, e) -> CC_Callcc (v, t' e)
+    | E_Callcc (v, e) ->
+        CC_Callcc (v, t (VarSet.add v bound) (VarMap.remove v slots) env_sym e)
     (* Var *)
-    | E_Var v -> cc_expr_of_var sub env_sym v
+    | E_Var v -> cc_expr_of_var slots env_sym v
+    (* Direct primitives take the continuation as the last argument. A continuation
+       lambda is inlined, so the result flows straight into its body. *)
+    | E_App (E_Prim p, args, _) when Builtins.is_direct p -> (
+        match List.rev args with
+        | E_Lambda ([ x ], body, _, _) :: rev_args ->
+            let op = CC_PrimOp (p, List.rev_map t' rev_args) in
+            CC_Let (x, op, t (VarSet.add x bound) (VarMap.remove x slots) env_sym body)
+        | k :: rev_args -> CC_App (t' k, [ CC_PrimOp (p, List.rev_map t' rev_args) ])
+        | [] -> failwith "primitive application without continuation")
+    (* Calls of known functions skip the closure and jump to the code directly *)
+    | E_App (E_Var f, args, line) when is_known_call bound f (List.length args - 1) -> (
+        match VarMap.find_opt f !prim_wrappers with
+        | Some p -> t' (E_App (E_Prim p, args, line))
+        | None -> CC_KnownApp (known_id f, List.map t' args))
+    (* An immediately applied lambda, like a let that Optimize kept or a join point, binds
+       its arguments in place instead of building a closure. After CPS they are atoms and
+       are bound one after another, which is only safe if none of them reads a parameter. *)
+    | E_App (E_Lambda (params, body, _, C_Cps), args, _)
+      when List.length params = List.length args
+           && List.for_all (fun a -> VarSet.disjoint (free a) (VarSet.of_list params)) args ->
+        let params' = List.map fresh_local params in
+        let renames = List.fold_left2 (fun acc p p' -> VarMap.add p p' acc) VarMap.empty params params' in
+        let body' = t (VarSet.union bound (VarSet.of_list params')) slots env_sym (rename_free renames body) in
+        List.fold_right2 (fun p a acc -> CC_Let (p, t' a, acc)) params' args body'
     (* App & Lambda *)
-    | E_App (fn, args) -> CC_App (t' fn, List.map t' args)
-    | E_Lambda (args, body) ->
-        let lamid = gen_lambda_id () in
-        let body' = t (free expr) "$env" body in
-        let env =
-          CC_MakeEnv
-            (List.map
-               (fun v -> (v, cc_expr_of_var sub env_sym v))
-               (VarSet.to_list @@ free expr))
+    | E_App (fn, args, _) -> CC_App (t' fn, List.map t' args)
+    | E_Lambda _ -> lambda (gen_lambda_id ()) bound (cc_expr_of_var slots env_sym) expr
+
+  (* Direct-style code (see Effects) is not in CPS: calls return their value. Renames maps
+     let-bound variables to their fresh names. *)
+  and d : VarSet.t -> int VarMap.t -> var -> var VarMap.t -> expr -> cc_expr =
+   fun bound slots env_sym renames expr ->
+    let d' = d bound slots env_sym renames in
+    match expr with
+    | E_Lit lit -> CC_Lit lit
+    | E_Var v -> direct_var slots env_sym renames v
+    | E_If (c, y, n) -> CC_If (d' c, d' y, d' n)
+    | E_App (E_Prim p, args, _) -> direct_args (List.map d' args) (fun args' -> CC_PrimOp (p, args'))
+    (* let and begin: the arguments are bound in order, then the body runs *)
+    | E_App (E_Lambda (params, body, _, _), args, _) when List.length params = List.length args ->
+        let args' = List.map d' args in
+        let params' = List.map fresh_local params in
+        let renames' = List.fold_left2 (fun acc p p' -> VarMap.add p p' acc) renames params params' in
+        let body' = d (VarSet.union bound (VarSet.of_list params)) slots env_sym renames' body in
+        List.fold_right2 direct_let params' args' body'
+    | E_App (E_Var f, args, line) when is_known_call bound f (List.length args) -> (
+        match (VarMap.find_opt f !prim_wrappers, VarMap.find f !known) with
+        | Some p, _ -> d' (E_App (E_Prim p, args, line))
+        | None, (id, _, C_Direct) -> direct_args (List.map d' args) (fun args' -> CC_DirectKnownApp (id, args'))
+        | None, (_, _, C_Cps) -> failwith "bug: direct-style code calls a function that may capture its continuation")
+    | E_App (fn, args, _) ->
+        direct_args (List.map d' (fn :: args)) (function
+          | fn' :: args' -> CC_DirectApp (fn', args')
+          | [] -> failwith "bug: direct_args lost the function")
+    | E_Lambda _ -> lambda (gen_lambda_id ()) bound (direct_var slots env_sym renames) expr
+    | E_Callcc _ -> failwith "bug: call/cc in a direct-style lambda"
+    | E_Prim _ -> failwith "bug: primitive outside of an application"
+
+  (* [lookup] gives the captured variables as seen from the enclosing function *)
+  and lambda : var -> VarSet.t -> (var -> cc_expr) -> expr -> cc_expr =
+   fun lamid bound lookup expr ->
+    match expr with
+    | E_Lambda (args, body, origin, convention) ->
+        let enclosing = !current_define in
+        let own =
+          match origin with
+          | O_Source (_, O_None) -> current_define := None; false
+          | O_Source (_, O_Own d) -> current_define := Some d; true
+          | O_Source (_, O_Inside d) -> current_define := Some d; false
+          | O_Continuation _ -> false
+        in
+        (* Globals are referenced directly, so only lexically bound variables are captured.
+           Each of them gets a fixed slot in the flat environment. *)
+        let captured = VarSet.elements (VarSet.inter (free expr) bound) in
+        let slots' = VarMap.of_seq (List.to_seq (List.mapi (fun i v -> (v, i)) captured)) in
+        let bound' = VarSet.union (VarSet.of_list captured) (VarSet.of_list args) in
+        let body' =
+          match convention with
+          | C_Cps -> t bound' slots' "$env" body
+          | C_Direct -> d bound' slots' "$env" VarMap.empty body
         in
-        append (CC_FuncDef (lamid, "$env" :: args, body'));
+        let env = CC_MakeEnv (List.map (fun v -> (v, lookup v)) captured) in
+        append (CC_FuncDef (lamid, "$env" :: args, body', convention, { define = !current_define; origin; own }));
+        current_define := enclosing;
         CC_MakeClosure (lamid, env)
+    | _ -> failwith "lambda: expected E_Lambda"
   in
 
-  (* FIXME 
-    I'm not sure if this's correct - like assume that we 
-    are inside the VarDef and reference previoously defined global def
-    need to check that this is working as expected.  
-
-    Ok, we don't pass global functions to the VarSet, even though we could. 
-    
-    What's going to happen now? actually it seems as it should work. If we call global functions
-    on the top level - it's not in the sub, works alright. If we call some lambdas, then those functions 
-    will be identified as free and passed to the env.
-  *)
+  (* Top-level defines are C globals. They are never captured: every reference,
+     including self-references of recursive functions, reads the global directly
+     (or is a direct call of a known function). *)
   let t_top : top_expr -> unit =
    fun top_expr ->
-    let t = t VarSet.empty "If this env is called, it's a bug" in
+    let t = t VarSet.empty VarMap.empty "If this env is called, it's a bug" in
+    current_define := (match top_expr with E_Define (name, _) -> Some name | E_Expr _ -> None);
     let transformed =
       match top_expr with
       | E_Expr e -> CC_Expr (t e)
+      (* A known function is a plain closure, built without going through the trampoline *)
+      | E_Define (name, E_App (E_Var "id", [ (E_Lambda _ as lam) ], _)) when VarMap.mem name !known ->
+          let lookup = cc_expr_of_var VarMap.empty "If this env is called, it's a bug" in
+          CC_VarDef (name, lambda (known_id name) VarSet.empty lookup lam)
       | E_Define (name, e) -> CC_VarDef (name, t e)
     in
     append transformed
   in
   fun exprs ->
+    find_known_functions exprs;
     List.iter t_top exprs;
-    !res
-
-(* Pretty printing for closure-converted AST *)
-let rec string_of_cc_expr = function
-  | CC_Lit (Ast.L_Bool b) -> string_of_bool b
-  | CC_Lit (Ast.L_Number n) -> string_of_int n
-  | CC_Lit (Ast.L_String s) -> "\"" ^ String.escaped s ^ "\""
-  | CC_Lit (Ast.L_Symbol s) -> "'" ^ s
-  | CC_Var v -> v
-  | CC_If (c, y, n) -> "(if " ^ string_of_cc_expr c ^ " " ^ string_of_cc_expr y ^ " " ^ string_of_cc_expr n ^ ")"
+    List.rev !res
+
+(* Pretty printing for closure-converted AST, into a buffer so that deep
+   expressions are not copied over and over *)
+let rec add_cc_expr (buf : Buffer.t) (e : cc_expr) : unit =
+  let add = Buffer.add_string buf in
+  let add_list f items = List.iteri (fun i x -> if i > 0 then add " "; f x) items in
+  let add_binding (name, e) = add "("; add name; add " "; add_cc_expr buf e; add ")" in
+  match e with
+  | CC_Lit (Ast.L_Bool b) -> add (string_of_bool b)
+  | CC_Lit (Ast.L_Number n) -> add (string_of_int n)
+  | CC_Lit (Ast.L_String s) -> add "\""; add (String.escaped s); add "\""
+  | CC_Lit (Ast.L_Symbol s) -> add "'"; add s
+  | CC_Var v -> add v
+  | CC_If (c, y, n) ->
+      add "(if "; add_cc_expr buf c; add " "; add_cc_expr buf y; add " "; add_cc_expr buf n; add ")"
   | CC_App (fn, args) ->
-      let args_str = String.concat " " (List.map string_of_cc_expr args) in
-      "(" ^ string_of_cc_expr fn ^ " " ^ args_str ^ ")"
-  | CC_MakeClosure (fn, env) -> "(closure " ^ fn ^ " " ^ string_of_cc_expr env ^ ")"
-  | CC_MakeEnv vars ->
-      let vars_str = String.concat " " (List.map (fun (name, e) -> "(" ^ name ^ " " ^ string_of_cc_expr e ^ ")") vars) in
-      "(env " ^ vars_str ^ ")"
-  | CC_EnvRef (env, var) -> "(env-ref " ^ env ^ " \"" ^ var ^ "\")"
-  | CC_Prim p -> "<prim:" ^ Builtins.builtin_to_string p ^ ">"
-  | CC_Callcc (v, e) -> "(callcc " ^ v ^ ". " ^ string_of_cc_expr e ^ ")"
-
-let string_of_cc_top_expr = function
-  | CC_FuncDef (name, args, body) ->
-      "(func-def " ^ name ^ " (" ^ String.concat " " args ^ ") " ^ string_of_cc_expr body ^ ")"
-  | CC_VarDef (name, expr) ->
-      "(var-def " ^ name ^ " " ^ string_of_cc_expr expr ^ ")"
-  | CC_Expr e ->
-      "(expr " ^ string_of_cc_expr e ^ ")"
+      add "("; add_cc_expr buf fn; add " "; add_list (add_cc_expr buf) args; add ")"
+  | CC_KnownApp (fn, args) ->
+      add "(known-call "; add fn; add " "; add_list (add_cc_expr buf) args; add ")"
+  | CC_DirectApp (fn, args) ->
+      add "(direct-apply "; add_cc_expr buf fn; add " "; add_list (add_cc_expr buf) args; add ")"
+  | CC_DirectKnownApp (fn, args) ->
+      add "(direct-call "; add fn; add " "; add_list (add_cc_expr buf) args; add ")"
+  | CC_MakeClosure (fn, env) -> add "(closure "; add fn; add " "; add_cc_expr buf env; add ")"
+  | CC_MakeEnv vars -> add "(env "; add_list add_binding vars; add ")"
+  | CC_EnvRef (env, slot, var) ->
+      add "(env-ref "; add env; add " "; add (string_of_int slot); add " \""; add var; add "\")"
+  | CC_Prim p -> add "<prim:"; add (Builtins.builtin_to_string p); add ">"
+  | CC_PrimOp (p, args) ->
+      add "(%"; add (Builtins.builtin_to_string p); add " "; add_list (add_cc_expr buf) args; add ")"
+  | CC_Let (x, e, body) ->
+      add "(let "; add x; add " "; add_cc_expr buf e; add " "; add_cc_expr buf body; add ")"
+  | CC_Loop body -> add "(loop "; add_cc_expr buf body; add ")"
+  | CC_Recur vals -> add "(recur "; add_list add_binding vals; add ")"
+  | CC_Callcc (v, e) -> add "(callcc "; add v; add ". "; add_cc_expr buf e; add ")"
+
+let add_cc_top_expr (buf : Buffer.t) (top : cc_top_expr) : unit =
+  let add = Buffer.add_string buf in
+  match top with
+  | CC_FuncDef (name, args, body, convention, _) ->
+      add (match convention with C_Cps -> "(func-def " | C_Direct -> "(direct-func-def ");
+      add name; add " ("; add (String.concat " " args); add ") ";
+      add_cc_expr buf body; add ")"
+  | CC_VarDef (name, expr) -> add "(var-def "; add name; add " "; add_cc_expr buf expr; add ")"
+  | CC_Expr e -> add "(expr "; add_cc_expr buf e; add ")"
+
+let string_of_cc_expr e =
+  let buf = Buffer.create 256 in
+  add_cc_expr buf e;
+  Buffer.contents buf
+
+let string_of_cc_top_expr top =
+  let buf = Buffer.create 256 in
+  add_cc_top_expr buf top;
+  Buffer.contents buf
@@ -17,7 +17,8 @@ type cps_top_expr = CPS_Expr of cps_cxpr | CPS_Define of var * cps_cxpr
 and cps_axpr =
   | CPS_Lit of Ast.lit
   | CPS_Var of var
-  | CPS_Lambda of var list * cps_cxpr
+  | CPS_Lambda of var list * cps_cxpr * origin
+  | CPS_DirectLambda of var list * expr * origin (* direct style, see Effects; the body is not converted *)
   | CPS_Prim of prim
   | CPS_Id (* Special function that should be called as base continuation *)
 
@@ -26,42 +27,74 @@ and cps_cxpr =
   | CPS_App of cps_axpr * cps_axpr list
   | CPS_If of cps_axpr * cps_cxpr * cps_cxpr
 
+(* One-pass (Danvy-Filinski style) CPS translation.
+
+   [t e k] translates [e] for a syntactic continuation [k].
+   [t_c e c] translates [e] for a meta-level continuation [c] that receives the
+   value of [e] as an atom. Atomic subterms are handed to [c] directly, so no
+   continuation lambda (and no closure + trampoline bounce at runtime) is
+   created for literals, variables and lambdas. A continuation lambda is only
+   reified when a non-atomic subterm actually needs one. *)
 let is_axpr = function E_Lit _ | E_Var _ | E_Lambda _ -> true | _ -> false
 
+(* Source line of an expression, used for the origin of the continuations
+   created for it *)
+let rec line_of = function
+  | E_App (_, _, line) | E_Lambda (_, _, (O_Source (line, _) | O_Continuation line), _) -> line
+  | E_If (c, y, n) -> (
+      match line_of c with 0 -> ( match line_of y with 0 -> line_of n | line -> line) | line -> line)
+  | E_Callcc (_, e) -> line_of e
+  | E_Lit _ | E_Var _ | E_Prim _ -> 0
+
 let rec m : expr -> cps_axpr = function
   | E_Lit lit -> CPS_Lit lit
   | E_Var v -> CPS_Var v
-  | E_Lambda (ids, body) ->
+  | E_Lambda (ids, body, origin, C_Direct) -> CPS_DirectLambda (ids, body, origin)
+  | E_Lambda (ids, body, origin, C_Cps) ->
       let k = gensym "k" in
       let body' = t body (CPS_Var k) in
-      CPS_Lambda (ids @ [ k ], body')
+      CPS_Lambda (ids @ [ k ], body', origin)
   | _ -> failwith "m expects expr that is atomic"
 
 (* Takes expression, it's continuation and translates it *)
 and t : expr -> cps_axpr -> cps_cxpr =
  fun e k ->
   match e with
-  | E_App (f, args) -> (
-      let argsyms = ref [] in
-      let fsym = gensym "f" in
-      let finl = match f with E_Prim p -> CPS_Prim p | _ -> CPS_Var fsym in
-      let rec aux = function
-        | [] -> CPS_App (finl, !argsyms @ [ k ])
-        | hd :: rest ->
-            let argsym = gensym "arg" in
-            argsyms := !argsyms @ [ CPS_Var argsym ];
-            t hd (CPS_Lambda ([ argsym ], aux rest))
-      in
-      match f with
-      | E_Prim _ -> aux args
-      | _ -> t f (CPS_Lambda ([ fsym ], aux args)))
-  | E_If (c, y, n) ->
-      let csym = gensym "c" in
-      t c (CPS_Lambda ([ csym ], CPS_If (CPS_Var csym, t y k, t n k)))
-  | E_Callcc (k', e) -> CPS_App (CPS_Lambda ([ k' ], t e k), [ k ])
+  | E_App (E_Prim p, args, _) ->
+      t_cs args (fun args' -> CPS_App (CPS_Prim p, args' @ [ k ]))
+  | E_App (f, args, _) ->
+      t_c f (fun f' -> t_cs args (fun args' -> CPS_App (f', args' @ [ k ])))
+  | E_If (c, y, n) -> (
+      match k with
+      (* Variables are cheap to duplicate into both branches *)
+      | CPS_Var _ | CPS_Id -> t_c c (fun c' -> CPS_If (c', t y k, t n k))
+      (* Otherwise bind the continuation once as a join point *)
+      | _ ->
+          let j = gensym "j" in
+          CPS_App
+            ( CPS_Lambda
+                ( [ j ],
+                  t_c c (fun c' -> CPS_If (c', t y (CPS_Var j), t n (CPS_Var j))),
+                  O_Continuation (line_of e) ),
+              [ k ] ))
+  | E_Callcc (k', body) -> CPS_App (CPS_Lambda ([ k' ], t body k, O_Continuation (line_of e)), [ k ])
   | E_Lit _ | E_Var _ | E_Lambda _ -> CPS_App (k, [ m e ])
   | E_Prim _ -> failwith "not expected prim in cps"
 
+and t_c : expr -> (cps_axpr -> cps_cxpr) -> cps_cxpr =
+ fun e c ->
+  if is_axpr e then c (m e)
+  else
+    let r = gensym "r" in
+    t e (CPS_Lambda ([ r ], c (CPS_Var r), O_Continuation (line_of e)))
+
+(* Translates expressions left to right, passing all their atoms to c *)
+and t_cs : expr list -> (cps_axpr list -> cps_cxpr) -> cps_cxpr =
+ fun es c ->
+  match es with
+  | [] -> c []
+  | hd :: rest -> t_c hd (fun hd' -> t_cs rest (fun rest' -> c (hd' :: rest')))
+
 let t_top : top_expr -> cps_top_expr =
  fun e ->
   match e with
@@ -72,15 +105,25 @@ let t_top : top_expr -> cps_top_expr =
 let rec from_cps_axpr : cps_axpr -> expr = function
   | CPS_Lit lit -> E_Lit lit
   | CPS_Var v -> E_Var v
-  | CPS_Lambda (ids, body) -> E_Lambda (ids, from_cps_cxpr body)
+  | CPS_Lambda (ids, body, origin) -> E_Lambda (ids, from_cps_cxpr body, origin, C_Cps)
+  | CPS_DirectLambda (ids, body, origin) -> E_Lambda (ids, from_direct body, origin, C_Direct)
   | CPS_Prim p -> E_Prim p
   | CPS_Id -> E_Var "id"
 
 and from_cps_cxpr : cps_cxpr -> expr = function
-  | CPS_App (f, args) -> E_App (from_cps_axpr f, List.map from_cps_axpr args)
+  | CPS_App (f, args) -> E_App (from_cps_axpr f, List.map from_cps_axpr args, 0)
   | CPS_If (c, y, n) ->
       E_If (from_cps_axpr c, from_cps_cxpr y, from_cps_cxpr n)
 
+(* Direct-style bodies stay as they are, except for the CPS lambdas in them *)
+and from_direct : expr -> expr = function
+  | E_Lambda (_, _, _, C_Cps) as lam -> from_cps_axpr (m lam)
+  | E_Lambda (ids, body, origin, C_Direct) -> E_Lambda (ids, from_direct body, origin, C_Direct)
+  | E_App (f, args, line) -> E_App (from_direct f, List.map from_direct args, line)
+  | E_If (c, y, n) -> E_If (from_direct c, from_direct y, from_direct n)
+  | E_Callcc _ -> failwith "bug: call/cc in a direct-style lambda"
+  | (E_Lit _ | E_Var _ | E_Prim _) as e -> e
+
 let from_cps_top : cps_top_expr -> top_expr = function
   | CPS_Expr e -> E_Expr (from_cps_cxpr e)
   | CPS_Define (v, e) -> E_Define (v, from_cps_cxpr e)
@@ -0,0 +1,121 @@
+open Lang
+open Ast
+
+(* Effect analysis for selective CPS.
+
+   CPS makes every return a call of a heap-allocated continuation and every call a
+   trampoline bounce, which only code that captures continuations needs. This pass marks
+   the lambdas whose body can never capture one as direct style (C_Direct); they are
+   compiled to C functions that return their value, and only the rest is CPS-converted.
+
+   Running a body may capture a continuation if it reaches call/cc, yield or
+   run-scheduler, calls a known function whose body may capture one, or makes an unknown
+   call while a function that may capture one, or a captured continuation, can be called
+   that way. Immediately applied lambdas, which let and begin become, run as part of the
+   body they appear in. *)
+
+module VarSet = Set.Make (String)
+module VarMap = Map.Make (String)
+
+type info = {
+  known : (var list * expr) VarMap.t; (* top-level functions defined once, as a lambda *)
+  capturing : VarSet.t; (* known functions whose body may capture a continuation *)
+  unknown_captures : bool; (* an unknown call may capture a continuation *)
+}
+
+let known_functions (exprs : top_expr list) : (var list * expr) VarMap.t =
+  let counts =
+    List.fold_left
+      (fun acc -> function
+        | E_Define (v, _) -> VarMap.update v (fun c -> Some (1 + Option.value c ~default:0)) acc
+        | E_Expr _ -> acc)
+      VarMap.empty exprs
+  in
+  List.fold_left
+    (fun acc -> function
+      | E_Define (v, E_Lambda (params, body, _, _)) when VarMap.find v counts = 1 -> VarMap.add v (params, body) acc
+      | _ -> acc)
+    VarMap.empty exprs
+
+(* Calls that Closures compiles as known calls; [bound] are the local variables in
+   scope, which shadow top-level functions *)
+let is_known_call (info : info) (bound : VarSet.t) (f : var) (argc : int) : bool =
+  match VarMap.find_opt f info.known with
+  | Some (params, _) -> List.length params = argc && not (VarSet.mem f bound)
+  | None -> false
+
+let bind (bound : VarSet.t) (params : var list) : VarSet.t = VarSet.union bound (VarSet.of_list params)
+
+(* True if evaluating [e] may capture a continuation *)
+let rec captures (info : info) (bound : VarSet.t) (e : expr) : bool =
+  let c = captures info bound in
+  match e with
+  | E_Lit _ | E_Var _ | E_Prim _ | E_Lambda _ -> false
+  | E_If (cond, y, n) -> c cond || c y || c n
+  | E_Callcc _ -> true
+  | E_App (E_Prim p, args, _) -> Builtins.captures_continuation p || List.exists c args
+  | E_App (E_Lambda (params, body, _, _), args, _) when List.length params = List.length args ->
+      List.exists c args || captures info (bind bound params) body
+  | E_App (E_Var f, args, _) when is_known_call info bound f (List.length args) ->
+      VarSet.mem f info.capturing || List.exists c args
+  | E_App (fn, args, _) -> info.unknown_captures || c fn || List.exists c args
+
+(* True if [e] lets something that may capture a continuation reach unknown calls: a
+   continuation captured by call/cc, a lambda whose body may capture one, or a known
+   function that may capture one used other than in a known call *)
+let rec escapes (info : info) (bound : VarSet.t) (e : expr) : bool =
+  let esc = escapes info bound in
+  match e with
+  | E_Lit _ | E_Prim _ -> false
+  | E_Var f -> VarSet.mem f info.capturing && not (VarSet.mem f bound)
+  | E_Callcc _ -> true
+  | E_If (cond, y, n) -> esc cond || esc y || esc n
+  | E_Lambda (params, body, _, _) -> captures info (bind bound params) body || escapes info (bind bound params) body
+  | E_App (E_Lambda (params, body, _, _), args, _) when List.length params = List.length args ->
+      List.exists esc args || escapes info (bind bound params) body
+  | E_App (E_Var f, args, _) when is_known_call info bound f (List.length args) -> List.exists esc args
+  | E_App (fn, args, _) -> esc fn || List.exists esc args
+
+(* Both facts only grow, from nothing captures to the fixpoint *)
+let analyze (exprs : top_expr list) : info =
+  let rec fix info =
+    let capturing =
+      VarMap.fold
+        (fun f (params, body) acc -> if captures info (VarSet.of_list params) body then VarSet.add f acc else acc)
+        info.known info.capturing
+    in
+    let info' = { info with capturing } in
+    let unknown_captures =
+      info.unknown_captures
+      || List.exists
+           (function
+             | E_Define (f, E_Lambda (params, body, _, _)) when VarMap.mem f info.known ->
+                 escapes info' (VarSet.of_list params) body
+             | E_Define (_, e) | E_Expr e -> escapes info' VarSet.empty e)
+           exprs
+    in
+    if VarSet.equal capturing info.capturing && unknown_captures = info.unknown_captures then info
+    else fix { info' with unknown_captures }
+  in
+  fix { known = known_functions exprs; capturing = VarSet.empty; unknown_captures = false }
+
+let rec mark_expr (info : info) (bound : VarSet.t) (e : expr) : expr =
+  let m = mark_expr info bound in
+  match e with
+  | E_Lit _ | E_Var _ | E_Prim _ -> e
+  | E_Lambda (params, body, origin, _) ->
+      let bound' = bind bound params in
+      let convention = if captures info bound' body then C_Cps else C_Direct in
+      E_Lambda (params, mark_expr info bound' body, origin, convention)
+  | E_App (fn, args, line) -> E_App (m fn, List.map m args, line)
+  | E_If (cond, y, n) -> E_If (m cond, m y, m n)
+  | E_Callcc (k, body) -> E_Callcc (k, mark_expr info (VarSet.add k bound) body)
+
+(* Marks the lambdas that can never capture a continuation as direct style *)
+let mark (exprs : top_expr list) : top_expr list =
+  let info = analyze exprs in
+  List.map
+    (function
+      | E_Define (v, e) -> E_Define (v, mark_expr info VarSet.empty e)
+      | E_Expr e -> E_Expr (mark_expr info VarSet.empty e))
+    exprs
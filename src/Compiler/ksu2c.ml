@@ -1,8 +1,8 @@
 open Lang
 open Closures
 
-(* Convert primitive to C function name *)
-let prim_to_c_name p =
+(* Convert primitive to the suffix shared by its C functions *)
+let prim_c_suffix p =
   let name = Builtins.builtin_to_string p in
   (* Special short names for common operators and predicates *)
   let sanitized = match name with
@@ -18,6 +18,24 @@ let prim_to_c_name p =
   | ">=" -> "ge"
   | "set!" -> "set"
   | "string->symbol" -> "string_to_symbol"
+  | "run-scheduler" -> "run_scheduler"
+  | "make-vector" -> "make_vector"
+  | "vector-ref" -> "vector_ref"
+  | "vector-set!" -> "vector_set"
+  | "vector-length" -> "vector_length"
+  | "vector->list" -> "vector_to_list"
+  | "list->vector" -> "list_to_vector"
+  | "make-hashtable" -> "make_hashtable"
+  | "hashtable-ref" -> "hashtable_ref"
+  | "hashtable-set!" -> "hashtable_set"
+  | "hashtable-delete!" -> "hashtable_delete"
+  | "hashtable-contains?" -> "hashtable_contains"
+  | "hashtable-count" -> "hashtable_count"
+  | "hashtable-keys" -> "hashtable_keys"
+  | "hashtable->list" -> "hashtable_to_list"
+  | "read-line" -> "read_line"
+  | "read-number" -> "read_number"
+  | "read-all" -> "read_all"
   (* Predicates: convert ? suffix to is_ prefix *)
   | _ when String.length name > 0 && name.[String.length name - 1] = '?' ->
       "is_" ^ String.sub name 0 (String.length name - 1)
@@ -29,126 +47,387 @@ let prim_to_c_name p =
       else
         sanitized
   in
-  "__builtin_" ^ sanitized
+  sanitized
+
+(* CPS entry point of a primitive, takes the continuation as the last argument *)
+let prim_to_c_name p = "__builtin_" ^ prim_c_suffix p
+
+(* Direct-style fast path of a primitive, returns the value *)
+let prim_to_c_inline_name p = "__prim_" ^ prim_c_suffix p
 
 (* Translation strategy:
 
    In C we have: global functions, global variable declarations, and main function.
-   ALL VALUES ARE HEAP-ALLOCATED POINTERS (Value pointers).
+   ALL VALUES ARE HEAP-ALLOCATED POINTERS (Value pointers), owned by the GC.
 
-   1. FuncDefs -> global C functions (return pointer, take pointer array)
-   2. VarDefs -> global pointer declaration + initialization in main
+   1. FuncDefs -> global C functions (return pointer, take pointer array), declared up front
+   2. VarDefs -> global pointer declaration + GC root registration and initialization in main
    3. Top-level Exprs -> execute in main
 
    All expressions use gcc block expression extension. *)
 
-let ksu2c: cc_top_expr list -> string =
-  let global_funcs = ref [] in
-  let global_decls = ref [] in
-  let main_body = ref [] in
+(* Emit code for the Cheney-on-the-M.T.A. runtime mode (see ksu_runtime.h) *)
+let cheney = ref false
+
+(* Emit code for a runtime built with counters (see ksu_runtime.h) *)
+let stats = ref false
+
+(* Source file named in the source map *)
+let source_file = ref ""
+
+(* Describes a function for the source map: the define it belongs to and how
+   it relates to it *)
+let source_entry ({ define; origin; own } : func_source) : string * string * int =
+  let define = match define with Some d -> Name_sanitizer.source_name d | None -> "<toplevel>" in
+  match origin with
+  | Ast.O_Source (line, _) when own -> (define, define, line)
+  | Ast.O_Source (line, _) -> (define, "lambda in " ^ define, line)
+  | Ast.O_Continuation 0 -> (define, "continuation in " ^ define, 0)
+  | Ast.O_Continuation line -> (define, Printf.sprintf "continuation of %s at line %d" define line, line)
+
+(* Direct-style code can only collect garbage in calls and loops (see ksu_runtime.h), so
+   only functions that contain one keep their variables in a frame *)
+let rec may_collect : cc_expr -> bool = function
+  | CC_DirectApp _ | CC_DirectKnownApp _ | CC_Loop _ | CC_PrimOp (Builtins.P_Touch, _) -> true
+  | CC_Lit _ | CC_Var _ | CC_EnvRef _ | CC_Prim _ -> false
+  | CC_MakeClosure (_, e) | CC_Callcc (_, e) -> may_collect e
+  | CC_MakeEnv vars | CC_Recur vars -> List.exists (fun (_, e) -> may_collect e) vars
+  | CC_App (fn, args) -> may_collect fn || List.exists may_collect args
+  | CC_KnownApp (_, args) | CC_PrimOp (_, args) -> List.exists may_collect args
+  | CC_If (c, y, n) -> may_collect c || may_collect y || may_collect n
+  | CC_Let (_, e, body) -> may_collect e || may_collect body
+
+(* Variables bound by lets in a direct-style function, in order; they are declared up front *)
+let let_bound (e : cc_expr) : Ast.var list =
+  let rec go acc = function
+    | CC_Let (x, e, body) -> go (go (x :: acc) e) body
+    | CC_If (c, y, n) -> go (go (go acc c) y) n
+    | CC_App (fn, args) | CC_DirectApp (fn, args) -> List.fold_left go (go acc fn) args
+    | CC_KnownApp (_, args) | CC_DirectKnownApp (_, args) | CC_PrimOp (_, args) -> List.fold_left go acc args
+    | CC_Loop e | CC_MakeClosure (_, e) | CC_Callcc (_, e) -> go acc e
+    | CC_MakeEnv vars | CC_Recur vars -> List.fold_left (fun acc (_, e) -> go acc e) acc vars
+    | CC_Lit _ | CC_Var _ | CC_EnvRef _ | CC_Prim _ -> acc
+  in
+  List.rev (go [] e)
+
+(* C type of the locals that hold values of a type *)
+let c_type : Types.ty -> string = function
+  | Types.T_Int -> "int"
+  | Types.T_Bool -> "bool"
+  | Types.T_Value -> "Value*"
+
+(* Adds the items of a list to the buffer, separated by sep *)
+let add_sep (buf : Buffer.t) (sep : string) (add_item : Buffer.t -> 'a -> unit) (items : 'a list) : unit =
+  List.iteri (fun i x -> if i > 0 then Buffer.add_string buf sep; add_item buf x) items
+
+(* Every section of the C file is built in its own buffer and each expression is
+   written straight into the buffer of its section, so emission is linear in the
+   size of the output. *)
+let ksu2c (oc : out_channel) (exprs : cc_top_expr list) : unit =
+  let global_funcs = Buffer.create 65536 in
+  let global_decls = Buffer.create 4096 in
+  let global_protos = Buffer.create 4096 in
+  let source_map = Buffer.create 4096 in
+  let main_body = Buffer.create 4096 in
+  let symbol_inits = Buffer.create 1024 in
+  let add = Buffer.add_string in
+
+  (* Symbol literals are interned once at startup, each distinct name in its own global *)
+  let symbols = Hashtbl.create 64 in
+  let symbol_global s =
+    match Hashtbl.find_opt symbols s with
+    | Some g -> g
+    | None ->
+        let g = "$symbol_" ^ string_of_int (Hashtbl.length symbols) in
+        Hashtbl.add symbols s g;
+        add global_decls ("static Value* " ^ g ^ ";\n");
+        add symbol_inits ("  " ^ g ^ " = MakeSymbol(\"" ^ String.escaped s ^ "\");\n");
+        g
+  in
+
+  (* What is known at the start of every function (see Types) *)
+  let entry = Types.entry (Types.function_results exprs) in
+
+  (* Whether the function being emitted is in direct style *)
+  let direct = ref false in
 
-  (* Translate expression to C expression string *)
-  let rec t_expr (e: cc_expr): string = match e with
+  (* Translate expression to C expression computing its boxed value; [env] is what is known
+     about the values of the variables there (see Types) *)
+  let rec t_expr (env : Types.env) (buf : Buffer.t) (e : cc_expr) : unit =
+    let add_args args = add_sep buf ", " (t_expr env) args in
+    let add_argv args =
+      if args = [] then add buf "NULL"
+      else (add buf "(Value*[]){"; add_args args; add buf "}")
+    in
+    match e with
   (* Literals - use constructors, actual structs on stack *)
-  | CC_Lit (Ast.L_Bool b) -> "MakeBool(" ^ string_of_bool b ^ ")"
-  | CC_Lit (Ast.L_Number n) -> "MakeInt(" ^ string_of_int n ^ ")"
-  | CC_Lit (Ast.L_String s) -> "MakeString(\"" ^ String.escaped s ^ "\")"
-  | CC_Lit (Ast.L_Symbol s) -> "MakeSymbol(\"" ^ String.escaped s ^ "\")"
+  | CC_Lit (Ast.L_Bool b) -> add buf "MakeBool("; add buf (string_of_bool b); add buf ")"
+  | CC_Lit (Ast.L_Number n) -> add buf "MakeInt("; add buf (string_of_int n); add buf ")"
+  | CC_Lit (Ast.L_String s) -> add buf "MakeString(\""; add buf (String.escaped s); add buf "\")"
+  | CC_Lit (Ast.L_Symbol s) -> add buf (symbol_global s)
 
-  (* Variables *)
-  | CC_Var v -> v
+  (* Variables; unboxed ones are boxed where their value escapes *)
+  | CC_Var v ->
+      (match Types.ty_of env e with
+      | Types.T_Int -> add buf "MakeInt("; add buf v; add buf ")"
+      | Types.T_Bool -> add buf "MakeBool("; add buf v; add buf ")"
+      | Types.T_Value -> add buf v)
 
   (* Control flow *)
   | CC_If (c, y, n) ->
-      "(is_true(" ^ t_expr c ^ ") ? " ^ t_expr y ^ " : " ^ t_expr n ^ ")"
+      let yes, no = Types.branches env c in
+      add buf "("; t_cond env buf c; add buf " ? "; t_expr yes buf y; add buf " : "; t_expr no buf n; add buf ")"
 
   (* Closures *)
-  | CC_MakeClosure (fn, env) ->
-      "MakeClosure(" ^ fn ^ ", " ^ t_expr env ^ ")"
+  | CC_MakeClosure (fn, CC_MakeEnv []) -> add buf "MakeClosure("; add buf fn; add buf ", NULL)"
+  | CC_MakeClosure (fn, CC_MakeEnv vars) ->
+      (* Variable names only end up in a debug side table, values are stored by slot *)
+      let names = fn ^ "_env_names" in
+      add global_decls ("static const char* const " ^ names ^ "[] = { ");
+      add_sep global_decls ", " (fun b (name, _) -> add b "\""; add b name; add b "\"") vars;
+      add global_decls " };\n";
+      add buf "MakeClosure("; add buf fn; add buf ", MakeEnv("; add buf (string_of_int (List.length vars));
+      add buf ", "; add buf names; add buf ", (Value*[]){";
+      add_sep buf ", " (fun b (_, e) -> t_expr env b e) vars;
+      add buf "}))"
+  | CC_MakeClosure _ -> failwith "CC_MakeClosure: expected CC_MakeEnv"
+  | CC_MakeEnv _ -> failwith "bug: CC_MakeEnv should be handled in CC_MakeClosure"
 
-  | CC_MakeEnv vars ->
-      let n = List.length vars in
-      (* Add one extra slot for self-reference patching (dirty fix for recursion) *)
-      if n = 0 then "MakeEnv(1, \"\", NULL)"
-      else
-        let args = List.map (fun (name, e) ->
-          let val_expr = match e with
-            | CC_Var v -> v  (* already a Value* pointer *)
-            | CC_EnvRef (env, var) -> "EnvRef(" ^ env ^ ", \"" ^ var ^ "\")"
-            | _ -> failwith "CC_MakeEnv: expected Var or EnvRef"
-          in
-          "\"" ^ name ^ "\", " ^ val_expr
-        ) vars in
-        (* First entry is reserved for self-reference *)
-        "MakeEnv(" ^ string_of_int (n + 1) ^ ", \"\", NULL, " ^ String.concat ", " args ^ ")"
-
-  | CC_EnvRef (env, var) ->
-      "EnvRef(" ^ env ^ ", \"" ^ var ^ "\")"  (* returns Value* directly *)
+  | CC_EnvRef (env, slot, _) ->
+      add buf "EnvRef("; add buf env; add buf ", "; add buf (string_of_int slot); add buf ")"  (* Value* directly *)
 
   (* Application *)
   | CC_App (fn, args) ->
-      let args_str = String.concat ", " (List.map t_expr args) in
       (match fn with
       (* | CC_Prim P_Set -> "not implemented" *)
       | CC_Prim p ->
-          prim_to_c_name p ^ "(" ^ args_str ^ ")"
+          add buf (prim_to_c_name p); add buf "("; add_args args; add buf ")"
       | _ ->
-          let fn_str = t_expr fn in
-          let argc = string_of_int (List.length args) in
-          let argv = if args_str = "" then "NULL" else "(Value*[]){" ^ args_str ^ "}" in
-          "ApplyClosure(" ^ fn_str ^ ", " ^ argc ^ ", " ^ argv ^ ")")
+          add buf "ApplyClosure("; t_expr env buf fn; add buf ", "; add buf (string_of_int (List.length args));
+          add buf ", "; add_argv args; add buf ")")
+
+  (* Known top-level functions have no environment and are called without a closure *)
+  | CC_KnownApp (fn, args) ->
+      add buf "CallKnown("; add buf fn; add buf ", "; add buf (string_of_int (List.length args));
+      add buf ", "; add_argv args; add buf ")"
+
+  (* Calls from direct-style code return the value *)
+  | CC_DirectApp (fn, args) ->
+      add buf "ApplyDirect("; t_expr env buf fn; add buf ", "; add buf (string_of_int (List.length args));
+      add buf ", "; add_argv args; add buf ")"
+  | CC_DirectKnownApp (fn, args) ->
+      add buf "CallKnownDirect("; add buf fn; add buf "_direct, "; add buf (string_of_int (List.length args));
+      add buf ", "; add_argv args; add buf ")"
+
+  (* Jumps back to the start of the enclosing loop; new values are computed before any
+     parameter is overwritten *)
+  | CC_Recur vals ->
+      add buf "({ ";
+      List.iteri (fun i (_, e) ->
+          add buf "Value* $next_"; add buf (string_of_int i); add buf " = "; t_expr env buf e; add buf "; ") vals;
+      List.iteri (fun i (name, _) ->
+          add buf name; add buf " = $next_"; add buf (string_of_int i); add buf "; ") vals;
+      add buf (if !direct then "continue; (Value*)NULL; })" else "continue; DoneThunk(NULL); })")
+  | CC_Loop _ -> failwith "bug: CC_Loop should be handled in CC_FuncDef"
 
   | CC_Prim _ -> failwith "bug: CC_Prim should be handled in CC_App"
+
+  (* Open-coded primitives; raw C operations when the operands are known to be unboxed *)
+  | CC_PrimOp (p, args) ->
+      (match raw_prim env p args with
+      | Some op ->
+          add buf (if Types.result_ty p = Types.T_Int then "MakeInt(" else "MakeBool("); op buf; add buf ")"
+      | None -> add buf (prim_to_c_inline_name p); add buf "("; add_args args; add buf ")")
+  | CC_Let (x, e, body) ->
+      add buf "({ "; t_bind env buf x e; t_expr (Types.bind (Types.after env e) x e) buf body; add buf "; })"
   | CC_Callcc _ -> failwith "callcc not implemented"
 
+  (* Translate expression of type T_Int or T_Bool to a C int or bool *)
+  and t_raw (env : Types.env) (buf : Buffer.t) (e : cc_expr) : unit =
+    match e with
+    | CC_Lit (Ast.L_Number n) -> add buf (string_of_int n)
+    | CC_Lit (Ast.L_Bool b) -> add buf (string_of_bool b)
+    | CC_Var v -> add buf v
+    | CC_PrimOp (p, args) ->
+        (match raw_prim env p args with
+        | Some op -> op buf
+        | None ->
+            (* The primitive checks its operands and its result is unboxed right away *)
+            add buf (if Types.result_ty p = Types.T_Int then "INT_VALUE(" else "BOOL_VALUE("); t_expr env buf e; add buf ")")
+    | CC_If (c, y, n) ->
+        let yes, no = Types.branches env c in
+        add buf "("; t_cond env buf c; add buf " ? "; t_raw yes buf y; add buf " : "; t_raw no buf n; add buf ")"
+    | CC_Let (x, e, body) ->
+        add buf "({ "; t_bind env buf x e; t_raw (Types.bind (Types.after env e) x e) buf body; add buf "; })"
+    | _ -> failwith "bug: expression has no unboxed type"
+
+  (* Condition of an if as a C bool *)
+  and t_cond (env : Types.env) (buf : Buffer.t) (c : cc_expr) : unit =
+    match Types.ty_of env c with
+    | Types.T_Bool -> t_raw env buf c
+    | _ -> add buf "is_true("; t_expr env buf c; add buf ")"
+
+  (* Start of a let: variables of direct-style functions are declared up front (see
+     direct_func), others in the block of the let with the C type of their value *)
+  and t_bind (env : Types.env) (buf : Buffer.t) (x : Ast.var) (e : cc_expr) : unit =
+    let ty = Types.ty_of env e in
+    if not !direct then add buf (c_type ty ^ " ");
+    add buf x; add buf " = ";
+    if ty = Types.T_Value then t_expr env buf e else t_raw env buf e;
+    add buf "; "
+
+  (* Raw C operation for a primitive whose operands are all known to have the type it checks.
+     Facts proved by one operand only hold once all of them are evaluated (see Types.after),
+     so they are only used to untag variables, which is safe at any time. *)
+  and raw_prim (env : Types.env) (p : Builtins.prim) (args : cc_expr list) : (Buffer.t -> unit) option =
+    let env_op = Types.after_all env args in
+    let operand ty a =
+      if Types.ty_of env a = ty then Some (fun buf -> t_raw env buf a)
+      else if Types.known env_op a = Some ty then
+        Some (fun buf -> add buf (if ty = Types.T_Int then "INT_VALUE(" else "BOOL_VALUE("); t_expr env buf a; add buf ")")
+      else None
+    in
+    let operands ty =
+      let ops = List.map (operand ty) args in
+      if List.for_all Option.is_some ops then Some (List.map Option.get ops) else None
+    in
+    let infix op = function
+      | [ a; b ] -> Some (fun buf -> add buf "("; a buf; add buf op; b buf; add buf ")")
+      | _ -> None
+    in
+    let call f = function
+      | [ a; b ] -> Some (fun buf -> add buf f; add buf "("; a buf; add buf ", "; b buf; add buf ")")
+      | _ -> None
+    in
+    let ints op = Option.bind (operands Types.T_Int) (infix op) in
+    let bools op = Option.bind (operands Types.T_Bool) (infix op) in
+    (* Values equal to an integer or a boolean are the same immediate *)
+    let same op =
+      let immediate a = Types.ty_of env a <> Types.T_Value || Types.known env_op a <> None in
+      if List.exists immediate args then infix op (List.map (fun a buf -> t_expr env buf a) args) else None
+    in
+    let first a b = match a with Some _ -> a | None -> b () in
+    match p with
+    | Builtins.P_Plus -> ints " + "
+    | Builtins.P_Minus -> ints " - "
+    | Builtins.P_Mult -> ints " * "
+    | Builtins.P_Div -> Option.bind (operands Types.T_Int) (call "__int_div")
+    | Builtins.P_Lt -> ints " < "
+    | Builtins.P_Le -> ints " <= "
+    | Builtins.P_Gt -> ints " > "
+    | Builtins.P_Ge -> ints " >= "
+    | Builtins.P_Eq -> first (ints " == ") (fun () -> first (bools " == ") (fun () -> same " == "))
+    | Builtins.P_Ne -> first (ints " != ") (fun () -> first (bools " != ") (fun () -> same " != "))
+    | Builtins.P_And -> bools " && "
+    | Builtins.P_Or -> bools " || "
+    | Builtins.P_Not ->
+        Option.bind (operands Types.T_Bool) (function
+          | [ a ] -> Some (fun buf -> add buf "(!"; a buf; add buf ")")
+          | _ -> None)
+    | _ -> None
+
+  in
+
+  (* A direct-style function is a C function that returns its value, called through
+     CallKnownDirect, and a CPS entry for its closure. Functions that may collect keep
+     the environment, the parameters and the boxed let-bound variables in a frame. *)
+  let direct_func (name : Ast.var) (params : Ast.var list) (body : cc_expr) : unit =
+    let buf = global_funcs in
+    let locals = let_bound body in
+    let types = Types.local_types body in
+    let boxed = List.filter (fun x -> VarMap.find x types = Types.T_Value) locals in
+    direct := true;
+    add buf ("Value* " ^ name ^ "_direct(ClosureEnv $env, int argc, Value** argv) {\n");
+    List.iteri (fun i a -> add buf ("  Value* " ^ a ^ " = argv[" ^ string_of_int i ^ "];\n")) params;
+    List.iter (fun x ->
+        match VarMap.find x types with
+        | Types.T_Int -> add buf ("  int " ^ x ^ " = 0;\n")
+        | Types.T_Bool -> add buf ("  bool " ^ x ^ " = false;\n")
+        | Types.T_Value -> add buf ("  Value* " ^ x ^ " = NULL;\n")) locals;
+    if may_collect body then begin
+      let roots = "(Value**)&$env" :: List.map (fun v -> "&" ^ v) (params @ boxed) in
+      add buf (Printf.sprintf "  KsuFrame $frame = { .size = %d, .roots = (Value**[]){ %s } };\n"
+                 (List.length roots) (String.concat ", " roots));
+      add buf ("  ksu_enter(&$frame, " ^ name ^ ");\n");
+      match body with
+      | CC_Loop body ->
+          (* Loops collect at every iteration when a collection is due *)
+          add buf "  for (;;) {\n    if (gc_pending) ksu_safepoint();\n";
+          add buf "    return ksu_leave(&$frame, "; t_expr entry buf body; add buf ");\n  }"
+      | _ -> add buf "  return ksu_leave(&$frame, "; t_expr entry buf body; add buf ");"
+    end
+    else (add buf "  return "; t_expr entry buf body; add buf ";");
+    add buf "\n}\n\n";
+    add buf ("Thunk " ^ name ^ "(ClosureEnv $env, int argc, Value** argv) {\n");
+    add buf ("  return ReturnDirect(" ^ name ^ "_direct, $env, argc, argv);\n}\n\n");
+    direct := false
   in
 
   (* Translate top-level expression *)
   let t_top (top: cc_top_expr): unit = match top with
-  | CC_FuncDef (name, args, body) ->
+  | CC_FuncDef (name, args, body, convention, source) ->
       (* First arg is always $env *)
       let c_args = match args with
-        | "$env" :: _ -> "EnvEntry* $env, int argc, Value** argv"
+        | "$env" :: _ -> "ClosureEnv $env, int argc, Value** argv"
         | _ -> failwith "CC_FuncDef: expected $env as first arg"
       in
-      let arg_bindings = match args with
-        | "$env" :: rest ->
-            List.mapi (fun i a -> "  Value* " ^ a ^ " = argv[" ^ string_of_int i ^ "];") rest
-        | _ -> []
-      in
-      let func =
-        "Thunk " ^ name ^ "(" ^ c_args ^ ") {\n" ^
-        String.concat "\n" arg_bindings ^
-        (if arg_bindings <> [] then "\n" else "") ^
-        "  return " ^ t_expr body ^ ";\n}"
-      in
-      global_funcs := !global_funcs @ [func]
+      (* Known calls may refer to functions that are emitted later *)
+      add global_protos ("Thunk " ^ name ^ "(" ^ c_args ^ ");\n");
+      if convention = Ast.C_Direct then add global_protos ("Value* " ^ name ^ "_direct(" ^ c_args ^ ");\n");
+      let define, description, line = source_entry source in
+      add source_map (Printf.sprintf "  { %s, \"%s\", \"%s\", \"%s\", %d },\n" name name
+                        (String.escaped define) (String.escaped description) line);
+      (match convention with
+      | Ast.C_Direct -> direct_func name (List.tl args) body
+      | Ast.C_Cps ->
+          let buf = global_funcs in
+          add buf ("Thunk " ^ name ^ "(" ^ c_args ^ ") {\n");
+          List.iteri (fun i a ->
+              add buf ("  Value* " ^ a ^ " = argv[" ^ string_of_int i ^ "];\n")) (List.tl args);
+          (match body with
+            | CC_Loop body ->
+                (* The loop never reaches a trampoline safepoint, so it bounces once a collection is due *)
+                let params = String.concat ", " (List.tl args) in
+                let argc = string_of_int (List.length args - 1) in
+                add buf "  for (;;) {\n";
+                add buf ("    if (gc_pending) return MakeThunk(" ^ name ^ ", $env, " ^ argc ^ ", (Value*[]){" ^ params ^ "});\n");
+                add buf "    return "; t_expr entry buf body; add buf ";\n  }"
+            | _ -> add buf "  return "; t_expr entry buf body; add buf ";");
+          add buf "\n}\n\n")
 
   | CC_VarDef (name, expr) ->
-      global_decls := !global_decls @ ["Value* " ^ name ^ ";"];
-      (* For closures, add self-reference patching *)
+      add global_decls ("Value* " ^ name ^ ";\n");
+      (* Globals are GC roots for the rest of the program *)
+      add main_body ("  gc_add_root(&" ^ name ^ ");\n");
+      add main_body ("  " ^ name ^ " = ");
       (match expr with
-      | CC_App (CC_Var "id", [ CC_MakeClosure _ ]) -> 
-          main_body := !main_body @ [name ^ " = Trampoline(" ^ t_expr expr ^ ");"];
-          main_body := !main_body @ [name ^ "->closure.env[0].val = " ^ name ^ ";"];
-          main_body := !main_body @ [name ^ "->closure.env[0].name = \"" ^ name ^ "\";"]
-      | CC_App _ ->
-          main_body := !main_body @ [name ^ " = Trampoline(" ^ t_expr expr ^ ");"]
-      | _ ->
-          main_body := !main_body @ [name ^ " = " ^ t_expr expr ^ ";"])
+      | CC_App _ | CC_KnownApp _ | CC_If _ | CC_Let _ ->
+          add main_body "Trampoline("; t_expr entry main_body expr; add main_body ");\n"
+      | _ -> t_expr entry main_body expr; add main_body ";\n")
 
   | CC_Expr e ->
-      match e with 
-      | CC_App _ -> main_body := !main_body @ ["Trampoline(" ^ t_expr e ^ ");"]
-      | _ -> main_body := !main_body @ [t_expr e ^ ";"]
+      add main_body "  ";
+      match e with
+      | CC_App _ | CC_KnownApp _ | CC_If _ | CC_Let _ ->
+          add main_body "Trampoline("; t_expr entry main_body e; add main_body ");\n"
+      | _ -> t_expr entry main_body e; add main_body ";\n"
   in
 
-  fun exprs ->
-    List.iter t_top exprs;
-
-    let header = "#include \"ksu_builtins.c\"\n\n" in
-    let decls = String.concat "\n" !global_decls in
-    let funcs = String.concat "\n\n" !global_funcs in
-    let body = String.concat "\n  " !main_body in
+  List.iter t_top exprs;
 
-    header ^ decls ^ "\n\n" ^ funcs ^ "\n\nint main() {\n  nil = MakeNil();\n  id = MakeClosure(__id_impl, NULL);\n  " ^ body ^ "\n}\n"
+  if !cheney then output_string oc "#define KSU_CHENEY 1\n";
+  if !stats then output_string oc "#define KSU_STATS 1\n";
+  output_string oc "#include \"ksu_runtime.h\"\n\n";
+  Buffer.output_buffer oc global_protos;
+  Printf.fprintf oc "const char* const ksu_source_file = \"%s\";\n" (String.escaped !source_file);
+  output_string oc "const KsuSourceInfo ksu_source_map[] = {\n";
+  Buffer.output_buffer oc source_map;
+  output_string oc "  { NULL, NULL, NULL, NULL, 0 }\n};\n";
+  Buffer.output_buffer oc global_decls;
+  output_string oc "\n";
+  Buffer.output_buffer oc global_funcs;
+  (* ksu_main runs the program on a thread with a big stack for direct-style code *)
+  output_string oc "static void ksu_program(void) {\n";
+  Buffer.output_buffer oc symbol_inits;
+  Buffer.output_buffer oc main_body;
+  output_string oc "}\n\nint main() {\n  return ksu_main(ksu_program);\n}\n"
@@ -0,0 +1,54 @@
+open Lang
+open Ast
+open Closures
+
+(* Turns self tail calls into loops.
+
+   After CPS every call is a tail call. A known call of a function from its own body
+   (calls from nested lambdas live in other FuncDefs) that passes the function's own
+   continuation therefore just restarts the function with new arguments. The body of such a
+   function is wrapped in CC_Loop and those calls become CC_Recur, which ksu2c emits as a C
+   loop that reassigns the parameters in place. Direct-style functions (see Effects) have no
+   continuation, and their known self calls in tail position are rewritten the same way. *)
+
+let rec split_last = function
+  | [] -> failwith "split_last: empty list"
+  | [ x ] -> ([], x)
+  | x :: rest ->
+      let init, last = split_last rest in
+      (x :: init, last)
+
+(* Rewrites self tail calls of [name] in tail positions of [e]; [params] are the
+   parameters without the continuation, and [ks] are the variables that hold the
+   continuation of the function: its last parameter and lets that bind it again. Direct-style
+   functions have no continuation. *)
+let rec rewrite (name : var) (params : var list) (ks : var list) (e : cc_expr) : cc_expr =
+  let r = rewrite name params ks in
+  match e with
+  | CC_KnownApp (fn, args) when fn = name -> (
+      match split_last args with
+      | vals, CC_Var k when List.mem k ks -> CC_Recur (List.combine params vals)
+      | _ -> e)
+  | CC_DirectKnownApp (fn, vals) when fn = name -> CC_Recur (List.combine params vals)
+  | CC_If (c, y, n) -> CC_If (c, r y, r n)
+  | CC_Let (x, v, body) ->
+      let ks' = match v with CC_Var v' when List.mem v' ks -> x :: ks | _ -> List.filter (( <> ) x) ks in
+      CC_Let (x, v, rewrite name params ks' body)
+  | _ -> e
+
+let rec has_recur : cc_expr -> bool = function
+  | CC_Recur _ -> true
+  | CC_If (_, y, n) -> has_recur y || has_recur n
+  | CC_Let (_, _, body) -> has_recur body
+  | _ -> false
+
+let convert : cc_top_expr list -> cc_top_expr list =
+  List.map (function
+    | CC_FuncDef (name, ("$env" :: (_ :: _ as args) as all_args), body, (C_Cps as convention), source) as top ->
+        let params, k = split_last args in
+        let body' = rewrite name params [ k ] body in
+        if has_recur body' then CC_FuncDef (name, all_args, CC_Loop body', convention, source) else top
+    | CC_FuncDef (name, ("$env" :: params as all_args), body, (C_Direct as convention), source) as top ->
+        let body' = rewrite name params [] body in
+        if has_recur body' then CC_FuncDef (name, all_args, CC_Loop body', convention, source) else top
+    | top -> top)
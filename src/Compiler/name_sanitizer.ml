@@ -42,22 +42,27 @@ let sanitize_var_name (name: string) : string =
 let sanitize_var_list (vars: var list) : var list =
   List.map sanitize_var_name vars
 
+(* Source names of defines, so that generated tables can show them *)
+let source_names : (var, var) Hashtbl.t = Hashtbl.create 64
+
 (* Sanitize lambda arguments *)
 let rec sanitize_lambda_args (args: var list) : var list =
   List.map sanitize_var_name args
 
 (* Sanitize define expressions *)
 and sanitize_define (name: var) : var =
-  sanitize_var_name name
+  let sanitized = sanitize_var_name name in
+  Hashtbl.replace source_names sanitized name;
+  sanitized
 
 (* Sanitize an entire expression recursively *)
 and sanitize_expr (expr: expr) : expr =
   match expr with
   | E_Var v -> E_Var (sanitize_var_name v)
-  | E_App (func, args) ->
-      E_App (sanitize_expr func, List.map sanitize_expr args)
-  | E_Lambda (args, body) ->
-      E_Lambda (sanitize_lambda_args args, sanitize_expr body)
+  | E_App (func, args, line) ->
+      E_App (sanitize_expr func, List.map sanitize_expr args, line)
+  | E_Lambda (args, body, origin, convention) ->
+      E_Lambda (sanitize_lambda_args args, sanitize_expr body, origin, convention)
   | E_If (cond, then_expr, else_expr) ->
       E_If (sanitize_expr cond, sanitize_expr then_expr, sanitize_expr else_expr)
   | E_Callcc (v, e) -> E_Callcc (sanitize_var_name v, sanitize_expr e)
@@ -74,3 +79,7 @@ let sanitize_top_expr (top_expr: top_expr) : top_expr =
 (* Sanitize a list of top-level expressions *)
 let sanitize_top_exprs (top_exprs: top_expr list) : top_expr list =
   List.map sanitize_top_expr top_exprs
+
+(* Name a sanitized define had in the source *)
+let source_name (name: var) : var =
+  Option.value (Hashtbl.find_opt source_names name) ~default:name
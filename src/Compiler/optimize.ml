@@ -0,0 +1,311 @@
+open Lang
+open Ast
+open Builtins
+
+(* AST optimizations, run after the name sanitizer and before the effect analysis and CPS.
+
+   Every program starts with the builtin definitions, a closure per primitive, and let and
+   begin are immediately applied lambdas. This pass
+   - beta-reduces immediately applied lambdas: arguments that can be copied or moved into
+     the body are substituted, the others stay bound in order,
+   - inlines calls of small non-recursive top-level functions, which turns calls of the
+     builtin definitions into primitive applications,
+   - folds primitive applications to constants and ifs with a constant condition,
+   - and drops defines of values that nothing references.
+
+   Variables are never assigned (set! works on boxes), so a variable can be read later
+   than it was bound, except for top-level names that are defined more than once. *)
+
+module VarSet = Set.Make (String)
+module VarMap = Map.Make (String)
+
+(* Bodies up to this size are inlined; the builtin definitions are 3 to 5 *)
+let inline_limit = 12
+
+type info = {
+  redefined : VarSet.t; (* top-level names defined more than once *)
+  inline : (var list * expr * origin * VarSet.t) VarMap.t; (* functions to inline, with their free variables *)
+  constants : lit VarMap.t; (* top-level names defined once as a constant *)
+}
+
+let fresh =
+  let cnt = ref 0 in
+  fun v ->
+    cnt := !cnt + 1;
+    v ^ "$o" ^ string_of_int !cnt
+
+let free = Closures.free
+
+let rec size (e : expr) : int =
+  match e with
+  | E_Lit _ | E_Var _ | E_Prim _ -> 1
+  | E_App (f, args, _) -> List.fold_left (fun n a -> n + size a) (1 + size f) args
+  | E_Lambda (_, body, _, _) | E_Callcc (_, body) -> 1 + size body
+  | E_If (c, y, n) -> 1 + size c + size y + size n
+
+(* Number of free occurrences of [v] in [e], and whether one of them is in a lambda or
+   under call/cc, where it may be evaluated more than once *)
+let rec uses (v : var) (e : expr) : int * bool =
+  let sum es =
+    List.fold_left
+      (fun (n, again) e ->
+        let n', again' = uses v e in
+        (n + n', again || again'))
+      (0, false) es
+  in
+  match e with
+  | E_Var x -> ((if x = v then 1 else 0), false)
+  | E_Lit _ | E_Prim _ -> (0, false)
+  | E_App (f, args, _) -> sum (f :: args)
+  | E_If (c, y, n) -> sum [ c; y; n ]
+  | E_Lambda (params, _, _, _) when List.mem v params -> (0, false)
+  | E_Callcc (k, _) when k = v -> (0, false)
+  | E_Lambda (_, body, _, _) | E_Callcc (_, body) ->
+      let n, _ = uses v body in
+      (n, n > 0)
+
+(* Variables that evaluating [e] reads, in order, before anything else can happen, and
+   whether evaluation goes on past [e] without a call or a primitive *)
+let rec leading (e : expr) : var list * bool =
+  match e with
+  | E_Var v -> ([ v ], true)
+  | E_Lit _ | E_Prim _ | E_Lambda _ -> ([], true)
+  | E_App (f, args, _) -> (fst (leading_seq (f :: args)), false)
+  | E_If (c, _, _) -> (fst (leading c), false)
+  | E_Callcc _ -> ([], false)
+
+and leading_seq (es : expr list) : var list * bool =
+  match es with
+  | [] -> ([], true)
+  | e :: rest -> (
+      match leading e with
+      | vs, true ->
+          let vs', goes_on = leading_seq rest in
+          (vs @ vs', goes_on)
+      | vs, false -> (vs, false))
+
+(* Replaces the free variables of [e] that [s] maps; [fv] are the free variables of the
+   replacements, and binders that would capture one of them are renamed *)
+let rec subst (s : expr VarMap.t) (fv : VarSet.t) (e : expr) : expr =
+  if VarMap.is_empty s then e
+  else
+    match e with
+    | E_Var v -> Option.value (VarMap.find_opt v s) ~default:e
+    | E_Lit _ | E_Prim _ -> e
+    | E_App (f, args, line) -> E_App (subst s fv f, List.map (subst s fv) args, line)
+    | E_If (c, y, n) -> E_If (subst s fv c, subst s fv y, subst s fv n)
+    | E_Lambda (params, body, origin, convention) ->
+        let params', (s', fv') =
+          List.fold_right
+            (fun p (ps, acc) ->
+              let p', acc' = rename acc p in
+              (p' :: ps, acc'))
+            params ([], (s, fv))
+        in
+        E_Lambda (params', subst s' fv' body, origin, convention)
+    | E_Callcc (k, body) ->
+        let k', (s', fv') = rename (s, fv) k in
+        E_Callcc (k', subst s' fv' body)
+
+and rename ((s, fv) : expr VarMap.t * VarSet.t) (p : var) : var * (expr VarMap.t * VarSet.t) =
+  let s = VarMap.remove p s in
+  if VarSet.mem p fv then
+    let p' = fresh p in
+    (p', (VarMap.add p (E_Var p') s, VarSet.add p' fv))
+  else (p, (s, fv))
+
+(* Arguments that are cheap to evaluate again wherever their parameter is used *)
+let copyable (info : info) (bound : VarSet.t) (e : expr) : bool =
+  match e with
+  | E_Lit (L_Bool _ | L_Number _ | L_Symbol _) -> true
+  | E_Var v -> VarSet.mem v bound || not (VarSet.mem v info.redefined)
+  | _ -> false
+
+(* Arguments without effects that build a new value, which may move to a single use *)
+let movable (e : expr) : bool = match e with E_Lambda _ | E_Lit (L_String _) -> true | _ -> false
+
+(* Values of C ints, which is what numbers are at runtime *)
+let fits (n : int) : bool = n >= Int32.to_int Int32.min_int && n <= Int32.to_int Int32.max_int
+
+(* Primitive applications on constants; errors, like division by zero, are left to runtime *)
+let fold (p : prim) (args : expr list) : expr option =
+  let number n = if fits n then Some (E_Lit (L_Number n)) else None in
+  let bool b = Some (E_Lit (L_Bool b)) in
+  match (p, args) with
+  | _, [ E_Lit (L_Number a); E_Lit (L_Number b) ] when fits a && fits b -> (
+      match p with
+      | P_Plus -> number (a + b)
+      | P_Minus -> number (a - b)
+      | P_Mult -> number (a * b)
+      | P_Div when b <> 0 -> number (a / b)
+      | P_Lt -> bool (a < b)
+      | P_Le -> bool (a <= b)
+      | P_Gt -> bool (a > b)
+      | P_Ge -> bool (a >= b)
+      | P_Eq -> bool (a = b)
+      | P_Ne -> bool (a <> b)
+      | _ -> None)
+  | (P_Eq | P_Ne), [ E_Lit ((L_Number _ | L_Bool _ | L_Symbol _) as a); E_Lit ((L_Number _ | L_Bool _ | L_Symbol _) as b) ] ->
+      bool ((a = b) = (p = P_Eq))
+  | P_And, [ E_Lit (L_Bool a); E_Lit (L_Bool b) ] -> bool (a && b)
+  | P_Or, [ E_Lit (L_Bool a); E_Lit (L_Bool b) ] -> bool (a || b)
+  | P_Not, [ E_Lit (L_Bool a) ] -> bool (not a)
+  | _ -> None
+
+(* [simplify info bound inline e] optimizes [e], where [bound] are the local variables in
+   scope, which shadow top-level names. Inlined bodies are optimized already, so the
+   expressions that beta-reduction builds are simplified again without inlining. *)
+let rec simplify (info : info) (bound : VarSet.t) (inline : bool) (e : expr) : expr =
+  let s = simplify info bound inline in
+  match e with
+  | E_Var v when not (VarSet.mem v bound) -> (
+      match VarMap.find_opt v info.constants with Some lit -> E_Lit lit | None -> e)
+  | E_Lit _ | E_Var _ | E_Prim _ -> e
+  | E_Lambda (params, body, origin, convention) ->
+      E_Lambda (params, simplify info (VarSet.union bound (VarSet.of_list params)) inline body, origin, convention)
+  | E_Callcc (k, body) -> E_Callcc (k, simplify info (VarSet.add k bound) inline body)
+  | E_If (c, y, n) -> (
+      match s c with
+      | E_Lit (L_Bool false) -> s n
+      | E_Lit _ -> s y
+      | c' -> E_If (c', s y, s n))
+  | E_App (f, args, line) -> (
+      let args' = List.map s args in
+      match f with
+      | E_Var v when inline && not (VarSet.mem v bound) -> (
+          match VarMap.find_opt v info.inline with
+          | Some (params, body, origin, fv)
+            when List.length params = List.length args && VarSet.disjoint fv bound ->
+              beta info bound params body origin args' line
+          | _ -> app info bound (s f) args' line)
+      | _ -> app info bound (s f) args' line)
+
+and app (info : info) (bound : VarSet.t) (f : expr) (args : expr list) (line : line) : expr =
+  match f with
+  | E_Prim p -> Option.value (fold p args) ~default:(E_App (f, args, line))
+  | E_Lambda (params, body, origin, _) when List.length params = List.length args ->
+      beta info bound params body origin args line
+  | _ -> E_App (f, args, line)
+
+(* ((lambda params body) args), with [args] simplified. Copyable arguments are
+   substituted, and so are movable ones with at most one use outside of lambdas. The
+   others have effects and stay bound, except for a last few that the body evaluates
+   first thing, in the same order, each once. *)
+and beta (info : info) (bound : VarSet.t) (params : var list) (body : expr) (origin : origin)
+    (args : expr list) (line : line) : expr =
+  let bindings = List.combine params args in
+  let substituted (p, a) =
+    copyable info bound a
+    ||
+    match uses p body with
+    | 0, _ -> movable a
+    | 1, again -> movable a && not again
+    | _ -> false
+  in
+  let effects = List.filter (fun b -> not (substituted b || movable (snd b))) bindings in
+  let order = fst (leading body) in
+  let rec first_suffix = function
+    | [] -> []
+    | _ :: rest as suffix ->
+        let names = List.map fst suffix in
+        if
+          List.for_all (fun p -> fst (uses p body) = 1) names
+          && List.filter (fun v -> List.mem v names) order = names
+        then suffix
+        else first_suffix rest
+  in
+  let moved = first_suffix effects in
+  let s, kept = List.partition (fun b -> substituted b || List.memq b moved) bindings in
+  let fv = List.fold_left (fun acc (_, a) -> VarSet.union acc (free a)) VarSet.empty s in
+  let again = List.exists (fun (_, a) -> match a with E_Lit _ | E_Lambda _ -> true | _ -> false) s in
+  let smap = VarMap.of_seq (List.to_seq s) in
+  match kept with
+  | [] ->
+      let body' = subst smap fv body in
+      if again then simplify info bound false body' else body'
+  | _ -> (
+      match subst smap fv (E_Lambda (List.map fst kept, body, origin, C_Cps)) with
+      | E_Lambda (params', body', origin, convention) ->
+          let body' = if again then simplify info (VarSet.union bound (VarSet.of_list params')) false body' else body' in
+          E_App (E_Lambda (params', body', origin, convention), List.map snd kept, line)
+      | _ -> failwith "bug: substitution turned a lambda into something else")
+
+let counts (exprs : top_expr list) : int VarMap.t =
+  List.fold_left
+    (fun acc -> function
+      | E_Define (v, _) -> VarMap.update v (fun c -> Some (1 + Option.value c ~default:0)) acc
+      | E_Expr _ -> acc)
+    VarMap.empty exprs
+
+(* Defines of values that no expression and no other live define references *)
+let drop_dead_defines (exprs : top_expr list) : top_expr list =
+  let is_value = function E_Lit _ | E_Var _ | E_Lambda _ | E_Prim _ -> true | E_App _ | E_If _ | E_Callcc _ -> false in
+  let defs =
+    List.fold_left
+      (fun acc -> function
+        | E_Define (v, e) -> VarMap.update v (fun es -> Some (e :: Option.value es ~default:[])) acc
+        | E_Expr _ -> acc)
+      VarMap.empty exprs
+  in
+  let rec mark live = function
+    | [] -> live
+    | v :: rest when VarSet.mem v live -> mark live rest
+    | v :: rest ->
+        let refs = List.concat_map (fun e -> VarSet.elements (free e)) (Option.value (VarMap.find_opt v defs) ~default:[]) in
+        mark (VarSet.add v live) (refs @ rest)
+  in
+  let roots =
+    List.concat_map
+      (function
+        | E_Expr e -> VarSet.elements (free e)
+        | E_Define (_, e) when not (is_value e) -> VarSet.elements (free e)
+        | E_Define _ -> [])
+      exprs
+  in
+  let live = mark VarSet.empty roots in
+  List.filter (function E_Define (v, e) -> VarSet.mem v live || not (is_value e) | E_Expr _ -> true) exprs
+
+(* Records in the source lambdas of a top-level expression the define they are written
+   in, which inlining does not change *)
+let attribute (top_expr : top_expr) : top_expr =
+  let rec mark owner e =
+    match e with
+    | E_Lit _ | E_Var _ | E_Prim _ -> e
+    | E_App (f, args, line) -> E_App (mark owner f, List.map (mark owner) args, line)
+    | E_Lambda (params, body, origin, convention) -> E_Lambda (params, mark owner body, own owner origin, convention)
+    | E_If (c, y, n) -> E_If (mark owner c, mark owner y, mark owner n)
+    | E_Callcc (k, body) -> E_Callcc (k, mark owner body)
+  and own owner = function O_Source (line, _) -> O_Source (line, owner) | origin -> origin in
+  match top_expr with
+  | E_Expr e -> E_Expr (mark O_None e)
+  | E_Define (v, E_Lambda (params, body, origin, convention)) ->
+      E_Define (v, E_Lambda (params, mark (O_Inside v) body, own (O_Own v) origin, convention))
+  | E_Define (v, e) -> E_Define (v, mark (O_Inside v) e)
+
+(* Optimizes top-level expressions in order. A function is inlined into the expressions
+   that follow its define, once its own body is optimized. *)
+let optimize (exprs : top_expr list) : top_expr list =
+  let exprs = List.map attribute exprs in
+  let counts = counts exprs in
+  let redefined = VarMap.fold (fun v n acc -> if n > 1 then VarSet.add v acc else acc) counts VarSet.empty in
+  let _, optimized =
+    List.fold_left
+      (fun (info, acc) -> function
+        | E_Expr e -> (info, E_Expr (simplify info VarSet.empty true e) :: acc)
+        | E_Define (v, e) ->
+            let e' = simplify info VarSet.empty true e in
+            let info =
+              match e' with
+              | _ when VarSet.mem v redefined -> info
+              | E_Lit ((L_Bool _ | L_Number _ | L_Symbol _) as lit) -> { info with constants = VarMap.add v lit info.constants }
+              | E_Lambda (params, body, origin, _) when size body <= inline_limit ->
+                  let fv = VarSet.diff (free body) (VarSet.of_list params) in
+                  if VarSet.mem v fv then info
+                  else { info with inline = VarMap.add v (params, body, origin, fv) info.inline }
+              | _ -> info
+            in
+            (info, E_Define (v, e') :: acc))
+      ({ redefined; inline = VarMap.empty; constants = VarMap.empty }, [])
+      exprs
+  in
+  drop_dead_defines (List.rev optimized)
@@ -0,0 +1,158 @@
+open Lang
+open Ast
+open Builtins
+open Closures
+
+(* Type inference for unboxed integers and booleans.
+
+   Numbers and booleans are immediates, but every arithmetic primitive still checks the tags
+   of its arguments and tags its result. This pass works out, at each point of a function,
+   what is known about the values there:
+   - expressions that always produce an integer or a boolean: literals, arithmetic,
+     comparisons and predicates. ksu2c computes them as raw C ints and bools, and keeps
+     let-bound variables of those types in int and bool locals, which are boxed only where
+     the value escapes: arguments of calls and continuations, environments, primitives that
+     take any value and the result of the function.
+   - boxed values that are known to be integers or booleans: variables that a primitive has
+     already checked (once (- n 1) has been evaluated, n is an integer in all the code that
+     runs after it, and in the branch of (if (number? n) ...) taken when the test holds),
+     and calls of known direct-style functions that always return one.
+   ksu2c uses raw C arithmetic and comparisons when all the operands are known. *)
+
+type ty = T_Int | T_Bool | T_Value
+
+type env = {
+  unboxed : ty VarMap.t; (* let-bound variables stored as C ints and bools *)
+  proved : ty VarMap.t; (* boxed variables known to hold an integer or a boolean *)
+  results : ty VarMap.t; (* known direct-style functions that always return an integer or a boolean *)
+}
+
+let empty : env = { unboxed = VarMap.empty; proved = VarMap.empty; results = VarMap.empty }
+
+(* Type of the arguments a primitive checks, if it checks them *)
+let operand_ty : prim -> ty option = function
+  | P_Plus | P_Minus | P_Mult | P_Div | P_Lt | P_Le | P_Gt | P_Ge -> Some T_Int
+  | P_And | P_Or | P_Not -> Some T_Bool
+  | _ -> None
+
+(* Type of the result of a primitive *)
+let result_ty : prim -> ty = function
+  | P_Plus | P_Minus | P_Mult | P_Div -> T_Int
+  | P_Lt | P_Le | P_Gt | P_Ge | P_Eq | P_Ne | P_And | P_Or | P_Not | P_IsNil | P_IsPair | P_IsNumber -> T_Bool
+  | _ -> T_Value
+
+(* Type of the C value of [e]: T_Int and T_Bool expressions are computed unboxed *)
+let rec ty_of (env : env) (e : cc_expr) : ty =
+  match e with
+  | CC_Lit (L_Number _) -> T_Int
+  | CC_Lit (L_Bool _) -> T_Bool
+  | CC_Var x -> Option.value (VarMap.find_opt x env.unboxed) ~default:T_Value
+  | CC_PrimOp (p, _) -> result_ty p
+  | CC_If (_, y, n) ->
+      let ty = ty_of env y in
+      if ty = ty_of env n then ty else T_Value
+  | CC_Let (x, e, body) -> ty_of (bind env x e) body
+  | _ -> T_Value
+
+(* Environment of the body of a let of [x] to [e] *)
+and bind (env : env) (x : var) (e : cc_expr) : env =
+  match ty_of env e with
+  | T_Value ->
+      let proved = match known env e with Some ty -> VarMap.add x ty env.proved | None -> VarMap.remove x env.proved in
+      { env with unboxed = VarMap.remove x env.unboxed; proved }
+  | ty -> { env with unboxed = VarMap.add x ty env.unboxed; proved = VarMap.remove x env.proved }
+
+(* Type known for the boxed value of [e] *)
+and known (env : env) (e : cc_expr) : ty option =
+  match e with
+  | CC_Var x -> VarMap.find_opt x env.proved
+  | CC_DirectKnownApp (f, _) -> VarMap.find_opt f env.results
+  | _ -> None
+
+let prove (env : env) (x : var) (ty : ty) : env =
+  if VarMap.mem x env.unboxed then env else { env with proved = VarMap.add x ty env.proved }
+
+(* Facts that hold in both environments *)
+let meet (a : env) (b : env) : env =
+  { a with proved = VarMap.filter (fun x ty -> VarMap.find_opt x b.proved = Some ty) a.proved }
+
+(* What is known once [e] has returned normally. Arguments of a call or a primitive are
+   evaluated in an unspecified order in C, so facts of one argument only hold after all of
+   them, never inside the others. *)
+let rec after (env : env) (e : cc_expr) : env =
+  match e with
+  | CC_Lit _ | CC_Var _ | CC_EnvRef _ | CC_Prim _ | CC_Callcc _ | CC_Loop _ | CC_Recur _ -> env
+  | CC_PrimOp (p, args) -> (
+      let env = after_all env args in
+      match operand_ty p with
+      | Some ty -> List.fold_left (fun env -> function CC_Var x -> prove env x ty | _ -> env) env args
+      | None -> env)
+  | CC_App (fn, args) | CC_DirectApp (fn, args) -> after_all env (fn :: args)
+  | CC_KnownApp (_, args) | CC_DirectKnownApp (_, args) -> after_all env args
+  | CC_MakeClosure (_, e) -> after env e
+  | CC_MakeEnv vars -> after_all env (List.map snd vars)
+  | CC_If (c, y, n) ->
+      let yes, no = branches env c in
+      meet (after yes y) (after no n)
+  | CC_Let (x, e, body) ->
+      (* The binding ends with the let; facts about an outer x it shadows are dropped *)
+      let env' = after (bind (after env e) x e) body in
+      { env with proved = VarMap.remove x env'.proved }
+
+and after_all (env : env) (es : cc_expr list) : env = List.fold_left after env es
+
+(* Environments of the two branches of an if on [c] *)
+and branches (env : env) (c : cc_expr) : env * env =
+  let env = after env c in
+  match c with
+  | CC_PrimOp (P_IsNumber, [ CC_Var x ]) -> (prove env x T_Int, env)
+  | _ -> (env, env)
+
+(* Type of the values that [e] returns: None when it never returns, like a self tail call
+   (CC_Recur). [assumed] are the types assumed for the results of direct-style functions. *)
+let rec returns (assumed : ty option VarMap.t) (env : env) (e : cc_expr) : ty option =
+  let join a b =
+    match (a, b) with None, t | t, None -> t | Some x, Some y -> if x = y then a else Some T_Value
+  in
+  match e with
+  | CC_Recur _ -> None
+  | CC_Loop e -> returns assumed env e
+  | CC_If (c, y, n) ->
+      let yes, no = branches env c in
+      join (returns assumed yes y) (returns assumed no n)
+  | CC_Let (x, v, body) -> returns assumed (bind (after env v) x v) body
+  | CC_DirectKnownApp (f, _) when VarMap.mem f assumed -> VarMap.find f assumed
+  | _ -> Some (match ty_of env e with T_Value -> Option.value (known env e) ~default:T_Value | ty -> ty)
+
+(* Direct-style functions that always return an integer or a boolean. Their results are
+   first assumed to be anything they return, so a recursive function returns an integer
+   when every path that ends the recursion does. *)
+let function_results (tops : cc_top_expr list) : ty VarMap.t =
+  let funcs =
+    List.filter_map (function CC_FuncDef (name, _, body, C_Direct, _) -> Some (name, body) | _ -> None) tops
+  in
+  let rec fix assumed =
+    let assumed' = List.fold_left (fun acc (name, body) -> VarMap.add name (returns assumed empty body) acc) VarMap.empty funcs in
+    if VarMap.equal ( = ) assumed assumed' then assumed else fix assumed'
+  in
+  let assumed = fix (List.fold_left (fun acc (name, _) -> VarMap.add name None acc) VarMap.empty funcs) in
+  VarMap.filter_map (fun _ -> function Some (T_Int | T_Bool as ty) -> Some ty | _ -> None) assumed
+
+(* Environment at the start of a function *)
+let entry (results : ty VarMap.t) : env = { empty with results }
+
+(* Types of the variables bound by lets in a direct-style function, which are declared up
+   front; the names there are unique *)
+let local_types (e : cc_expr) : ty VarMap.t =
+  let rec go env acc = function
+    | CC_Let (x, e, body) ->
+        let acc = go env acc e in
+        go (bind env x e) (VarMap.add x (ty_of env e) acc) body
+    | CC_If (c, y, n) -> go env (go env (go env acc c) y) n
+    | CC_App (fn, args) | CC_DirectApp (fn, args) -> List.fold_left (go env) acc (fn :: args)
+    | CC_KnownApp (_, args) | CC_DirectKnownApp (_, args) | CC_PrimOp (_, args) -> List.fold_left (go env) acc args
+    | CC_Loop e | CC_MakeClosure (_, e) | CC_Callcc (_, e) -> go env acc e
+    | CC_MakeEnv vars | CC_Recur vars -> List.fold_left (fun acc (_, e) -> go env acc e) acc vars
+    | CC_Lit _ | CC_Var _ | CC_EnvRef _ | CC_Prim _ -> acc
+  in
+  go empty VarMap.empty e
@@ -10,61 +10,95 @@ type lit =
 type top_expr = E_Expr of expr | E_Define of var * expr
 and var = string
 
+(* Source line of an application or lambda, 0 when it has none (builtins,
+   desugared lists) *)
+and line = int
+
+(* Where a lambda comes from: written in the source, or created by CPS
+   conversion to continue the call at the given line *)
+and origin = O_Source of line * owner | O_Continuation of line
+
+(* The define a source lambda is written in: none for top-level expressions, the
+   define whose value it is, or the define it is nested in. The parser leaves it
+   at O_None; Optimize fills it in before inlining moves code between defines. *)
+and owner = O_None | O_Own of var | O_Inside of var
+
+(* How a lambda is called: in CPS, with its continuation as the last argument,
+   or in direct style, returning its value. Lambdas start out in CPS; the
+   effect analysis moves those that can never capture a continuation to direct
+   style. *)
+and convention = C_Cps | C_Direct
+
 and expr =
   | E_Lit of lit
   | E_Var of var
-  | E_App of expr * expr list
-  | E_Lambda of var list * expr
+  | E_App of expr * expr list * line
+  | E_Lambda of var list * expr * origin * convention
   | E_If of expr * expr * expr
   | E_Callcc of var * expr
   | E_Prim of prim
 
-(* Stringifies the AST *)
-let string_of_expr expr =
-  let rec string_of_expr_aux offset expr =
+(* Stringifies the AST into a buffer *)
+let add_expr (buf : Buffer.t) expr =
+  let add = Buffer.add_string buf in
+  let rec add_expr_aux offset expr =
     match expr with
-    | E_Lit (L_Bool b) -> string_of_bool b
-    | E_Lit (L_Number n) -> string_of_int n
-    | E_Lit (L_String s) -> "\"" ^ s ^ "\""
-    | E_Lit (L_Symbol s) -> "'" ^ s
-    | E_Var s -> s
-    | E_App (func, args) ->
-        "("
-        ^ string_of_expr_aux offset func
-        ^ " "
-        ^ String.concat " " (List.map (string_of_expr_aux (offset + 2)) args)
-        ^ ")"
-    | E_Lambda (ids, body) ->
-        let indent = String.make offset ' ' in
-        "(lambda (" ^ String.concat " " ids ^ ")\n" ^ indent ^ "  "
-        ^ string_of_expr_aux (offset + 2) body
-        ^ ")"
+    | E_Lit (L_Bool b) -> add (string_of_bool b)
+    | E_Lit (L_Number n) -> add (string_of_int n)
+    | E_Lit (L_String s) -> add "\""; add s; add "\""
+    | E_Lit (L_Symbol s) -> add "'"; add s
+    | E_Var s -> add s
+    | E_App (func, args, _) ->
+        add "(";
+        add_expr_aux offset func;
+        add " ";
+        List.iteri (fun i arg -> if i > 0 then add " "; add_expr_aux (offset + 2) arg) args;
+        add ")"
+    | E_Lambda (ids, body, _, convention) ->
+        add (match convention with C_Cps -> "(lambda (" | C_Direct -> "(direct-lambda (");
+        add (String.concat " " ids);
+        add ")\n";
+        add (String.make (offset + 2) ' ');
+        add_expr_aux (offset + 2) body;
+        add ")"
     | E_If (cond, y, n) ->
-        let indent = String.make offset ' ' in
-        "(if "
-        ^ string_of_expr_aux offset cond
-        ^ "\n" ^ indent ^ "    "
-        ^ string_of_expr_aux (offset + 4) y
-        ^ "\n" ^ indent ^ "    "
-        ^ string_of_expr_aux (offset + 4) n
-        ^ ")"
-    | E_Callcc (v, e) -> "(callcc " ^ v ^ ". " ^  string_of_expr_aux (offset + 2) e ^ ")"
-    | E_Prim prim -> "<primitive: \"" ^ Builtins.builtin_to_string prim ^ "\">"
+        let indent = String.make (offset + 4) ' ' in
+        add "(if ";
+        add_expr_aux offset cond;
+        add "\n"; add indent;
+        add_expr_aux (offset + 4) y;
+        add "\n"; add indent;
+        add_expr_aux (offset + 4) n;
+        add ")"
+    | E_Callcc (v, e) -> add "(callcc "; add v; add ". "; add_expr_aux (offset + 2) e; add ")"
+    | E_Prim prim -> add "<primitive: \""; add (Builtins.builtin_to_string prim); add "\">"
   in
-  string_of_expr_aux 0 expr
+  add_expr_aux 0 expr
+
+let string_of_expr expr =
+  let buf = Buffer.create 256 in
+  add_expr buf expr;
+  Buffer.contents buf
 
 let string_of_top_expr top_expr =
-  match top_expr with
-  | E_Expr e -> string_of_expr e ^ "\n"
+  let buf = Buffer.create 256 in
+  (match top_expr with
+  | E_Expr e -> add_expr buf e
   | E_Define (name, expr) ->
-      "(define " ^ name ^ "\n  " ^ string_of_expr expr ^ ")\n"
+      Buffer.add_string buf "(define ";
+      Buffer.add_string buf name;
+      Buffer.add_string buf "\n  ";
+      add_expr buf expr;
+      Buffer.add_string buf ")");
+  Buffer.add_string buf "\n";
+  Buffer.contents buf
 
 (* Helper functions for creating builtin definitions *)
 let mk_var name = E_Var name
-let mk_lambda params body = E_Lambda (params, body)
+let mk_lambda params body = E_Lambda (params, body, O_Source (0, O_None), C_Cps)
 
 let mk_prim_app prim vars =
-  E_App (E_Prim prim, List.map mk_var vars)
+  E_App (E_Prim prim, List.map mk_var vars, 0)
 
 let mk_define name expr = E_Define (name, expr)
 
@@ -131,4 +165,40 @@ let builtin_definitions : top_expr list =
     mk_define "symbol?" (mk_lambda [ "a0" ] (mk_prim_app Builtins.P_IsSymbol [ "a0" ]));
     mk_define "raise" (mk_lambda [ "a0" ] (mk_prim_app Builtins.P_Raise [ "a0" ]));
     mk_define "!" (mk_lambda [ "x" ] (mk_prim_app Builtins.P_Unwrap [ "x" ]));
+    (* Green threads *)
+    mk_define "spawn" (mk_lambda [ "a0" ] (mk_prim_app Builtins.P_Spawn [ "a0" ]));
+    mk_define "yield" (mk_lambda [] (mk_prim_app Builtins.P_Yield []));
+    mk_define "run-scheduler" (mk_lambda [] (mk_prim_app Builtins.P_RunScheduler []));
+    (* Futures *)
+    mk_define "future" (mk_lambda [ "a0" ] (mk_prim_app Builtins.P_Future [ "a0" ]));
+    mk_define "touch" (mk_lambda [ "a0" ] (mk_prim_app Builtins.P_Touch [ "a0" ]));
+    (* Vectors *)
+    mk_define "make-vector"
+      (mk_lambda [ "a0"; "a1" ] (mk_prim_app Builtins.P_MakeVector [ "a0"; "a1" ]));
+    mk_define "vector-ref"
+      (mk_lambda [ "a0"; "a1" ] (mk_prim_app Builtins.P_VectorRef [ "a0"; "a1" ]));
+    mk_define "vector-set!"
+      (mk_lambda [ "a0"; "a1"; "a2" ] (mk_prim_app Builtins.P_VectorSet [ "a0"; "a1"; "a2" ]));
+    mk_define "vector-length" (mk_lambda [ "a0" ] (mk_prim_app Builtins.P_VectorLength [ "a0" ]));
+    mk_define "vector->list" (mk_lambda [ "a0" ] (mk_prim_app Builtins.P_VectorToList [ "a0" ]));
+    mk_define "list->vector" (mk_lambda [ "a0" ] (mk_prim_app Builtins.P_ListToVector [ "a0" ]));
+    mk_define "vector?" (mk_lambda [ "a0" ] (mk_prim_app Builtins.P_IsVector [ "a0" ]));
+    (* Hash tables *)
+    mk_define "make-hashtable" (mk_lambda [] (mk_prim_app Builtins.P_MakeHashtable []));
+    mk_define "hashtable-ref"
+      (mk_lambda [ "a0"; "a1"; "a2" ] (mk_prim_app Builtins.P_HashtableRef [ "a0"; "a1"; "a2" ]));
+    mk_define "hashtable-set!"
+      (mk_lambda [ "a0"; "a1"; "a2" ] (mk_prim_app Builtins.P_HashtableSet [ "a0"; "a1"; "a2" ]));
+    mk_define "hashtable-delete!"
+      (mk_lambda [ "a0"; "a1" ] (mk_prim_app Builtins.P_HashtableDelete [ "a0"; "a1" ]));
+    mk_define "hashtable-contains?"
+      (mk_lambda [ "a0"; "a1" ] (mk_prim_app Builtins.P_HashtableContains [ "a0"; "a1" ]));
+    mk_define "hashtable-count" (mk_lambda [ "a0" ] (mk_prim_app Builtins.P_HashtableCount [ "a0" ]));
+    mk_define "hashtable-keys" (mk_lambda [ "a0" ] (mk_prim_app Builtins.P_HashtableKeys [ "a0" ]));
+    mk_define "hashtable->list" (mk_lambda [ "a0" ] (mk_prim_app Builtins.P_HashtableToList [ "a0" ]));
+    mk_define "hashtable?" (mk_lambda [ "a0" ] (mk_prim_app Builtins.P_IsHashtable [ "a0" ]));
+    (* Input *)
+    mk_define "read-line" (mk_lambda [] (mk_prim_app Builtins.P_ReadLine []));
+    mk_define "read-number" (mk_lambda [] (mk_prim_app Builtins.P_ReadNumber []));
+    mk_define "read-all" (mk_lambda [] (mk_prim_app Builtins.P_ReadAll []));
   ]
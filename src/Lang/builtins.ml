@@ -30,6 +30,30 @@ type prim =
   | P_Nil
   | P_IsSymbol
   | P_Raise
+  | P_Spawn
+  | P_Yield
+  | P_RunScheduler
+  | P_Future
+  | P_Touch
+  | P_MakeVector
+  | P_VectorRef
+  | P_VectorSet
+  | P_VectorLength
+  | P_VectorToList
+  | P_ListToVector
+  | P_IsVector
+  | P_MakeHashtable
+  | P_HashtableRef
+  | P_HashtableSet
+  | P_HashtableDelete
+  | P_HashtableContains
+  | P_HashtableCount
+  | P_HashtableKeys
+  | P_HashtableToList
+  | P_IsHashtable
+  | P_ReadLine
+  | P_ReadNumber
+  | P_ReadAll
 
 (* Convert builtin to its Ksu name (for pretty-printing AST) *)
 let builtin_to_string = function
@@ -62,4 +86,41 @@ let builtin_to_string = function
   | P_StringToSymbol -> "string->symbol"
   | P_IsSymbol -> "symbol?"
   | P_Raise -> "raise"
+  | P_Spawn -> "spawn"
+  | P_Yield -> "yield"
+  | P_RunScheduler -> "run-scheduler"
+  | P_Future -> "future"
+  | P_Touch -> "touch"
+  | P_MakeVector -> "make-vector"
+  | P_VectorRef -> "vector-ref"
+  | P_VectorSet -> "vector-set!"
+  | P_VectorLength -> "vector-length"
+  | P_VectorToList -> "vector->list"
+  | P_ListToVector -> "list->vector"
+  | P_IsVector -> "vector?"
+  | P_MakeHashtable -> "make-hashtable"
+  | P_HashtableRef -> "hashtable-ref"
+  | P_HashtableSet -> "hashtable-set!"
+  | P_HashtableDelete -> "hashtable-delete!"
+  | P_HashtableContains -> "hashtable-contains?"
+  | P_HashtableCount -> "hashtable-count"
+  | P_HashtableKeys -> "hashtable-keys"
+  | P_HashtableToList -> "hashtable->list"
+  | P_IsHashtable -> "hashtable?"
+  | P_ReadLine -> "read-line"
+  | P_ReadNumber -> "read-number"
+  | P_ReadAll -> "read-all"
 
+
+(* Primitives that only compute a value. The compiler open-codes them in direct style and
+   hands the result to the continuation; the others are called in CPS with the continuation. *)
+let is_direct = function
+  | P_Raise | P_Nil | P_Spawn | P_Yield | P_RunScheduler | P_Touch -> false
+  | _ -> true
+
+(* Primitives that capture the continuation of their caller to switch tasks. Functions
+   that may reach them stay in CPS (see Effects); the others have a direct-style
+   __prim_ entry as well. *)
+let captures_continuation = function
+  | P_Yield | P_RunScheduler -> true
+  | _ -> false
@@ -1,7 +1,19 @@
 #include "ksu_runtime.h"
 
-// ============ FORWARD DECLARATIONS ============
-Value* deep_copy(Value* v);
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// The parts of the runtime that implement the language builtins. Together with
+// ksu_runtime.c this is prebuilt into libksu.a; generated programs only see
+// the declarations and inline fast paths in ksu_runtime.h.
 
 static const char* type_to_string(ValueTag t) {
     switch (t) {
@@ -13,41 +25,39 @@ static const char* type_to_string(ValueTag t) {
         case CLOSURE: return "CLOSURE";
         case BOX: return "BOX";
         case SYMBOL: return "SYMBOL";
+        case FUTURE: return "FUTURE";
+        case VECTOR: return "VECTOR";
+        case HASHTABLE: return "HASHTABLE";
         default: return "UNKNOWN";
     }
 }
 
 // ============ CONSTRUCTORS ============
-Value* MakeInt(int x) {
-    Value* ptr = malloc(sizeof(Value));
-    ptr->integer.t = NUMBER;
-    ptr->integer.value = x;
-    return ptr;
-}
-
-Value* MakeBool(bool x) {
-    Value* ptr = malloc(sizeof(Value));
-    ptr->boolean.t = BOOLEAN;
-    ptr->boolean.value = x;
-    return ptr;
-}
-
+// MakeInt, MakeBool and MakeNil build immediates, see ksu_runtime.h.
 Value* MakeString(const char* x) {
-    Value* ptr = malloc(sizeof(Value));
+    Value* ptr = gc_alloc(GC_VALUE, sizeof(Value));
+    KSU_STAT(allocs[STRING]);
     ptr->string.t = STRING;
     ptr->string.value = (char*)x;
     return ptr;
 }
 
-Value* MakeNil(void) {
-    Value* ptr = malloc(sizeof(Value));
-    ptr->nil.t = NIL;
+// A string built at run time keeps its characters right after the value
+Value* MakeStringCopy(const char* x, size_t length) {
+    Value* ptr = gc_alloc(GC_VALUE, sizeof(struct ValueString) + length + 1);
+    KSU_STAT(allocs[STRING]);
+    ptr->string.t = STRING;
+    ptr->string.value = (char*)ptr + sizeof(struct ValueString);
+    memcpy(ptr->string.value, x, length);
+    ptr->string.value[length] = '\0';
     return ptr;
 }
 
 Value* MakePair(Value* l, Value* r) {
-    Value* ptr = malloc(sizeof(Value));
+    Value* ptr = gc_alloc(GC_VALUE, sizeof(Value));
+    KSU_STAT(allocs[PAIR]);
     ptr->pair.t = PAIR;
+    ptr->pair.has_box = contains_box(l) || contains_box(r);
     ptr->pair.first = l;
     ptr->pair.second = r;
     return ptr;
@@ -58,10 +68,8 @@ Value* MakeClosure(Lambda_t f, ClosureEnv e) {
         fprintf(stderr, "MakeClosure: NULL lambda pointer\n");
         runtime_error("Cannot create closure with NULL lambda");
     }
-    Value* ptr = malloc(sizeof(Value));
-    if (ptr == NULL) {
-        runtime_error("MakeClosure: malloc failed");
-    }
+    Value* ptr = gc_alloc(GC_VALUE, sizeof(Value));
+    KSU_STAT(allocs[CLOSURE]);
     ptr->closure.t = CLOSURE;
     ptr->closure.lam = f;
     ptr->closure.env = e;
@@ -69,16 +77,41 @@ Value* MakeClosure(Lambda_t f, ClosureEnv e) {
 }
 
 Value* MakeBox(Value* v) {
-    Value* ptr = malloc(sizeof(Value));
+    Value* ptr = gc_alloc(GC_VALUE, sizeof(Value));
+    KSU_STAT(allocs[BOX]);
     ptr->box.t = BOX;
-    ptr->box.ptr = deep_copy(v);
+    ptr->box.ptr = v;
     return ptr;
 }
 
-Value* MakeSymbol(const char* name) {
-    Value* ptr = malloc(sizeof(Value));
-    ptr->symbol.t = SYMBOL;
-    ptr->symbol.name = (char*)name;
+Value* MakeFuture(Value* thunk) {
+    Value* ptr = gc_alloc(GC_VALUE, sizeof(Value));
+    KSU_STAT(allocs[FUTURE]);
+    ptr->future.t = FUTURE;
+    atomic_init(&ptr->future.state, 0);
+    ptr->future.thunk = thunk;
+    ptr->future.value = NULL;
+    return ptr;
+}
+
+Value* MakeVector(int length, Value* fill) {
+    Value* ptr = gc_alloc(GC_VALUE, sizeof(struct ValueVector) + sizeof(Value*) * length);
+    KSU_STAT(allocs[VECTOR]);
+    ptr->vector.t = VECTOR;
+    ptr->vector.length = length;
+    ptr->vector.items = (Value**)((char*)ptr + sizeof(struct ValueVector));
+    for (int i = 0; i < length; i++) {
+        ptr->vector.items[i] = fill;
+    }
+    return ptr;
+}
+
+Value* MakeHashtable(int capacity) {
+    Value* ptr = gc_alloc(GC_VALUE, sizeof(Value));
+    KSU_STAT(allocs[HASHTABLE]);
+    ptr->hashtable.t = HASHTABLE;
+    ptr->hashtable.count = 0;
+    ptr->hashtable.entries = MakeVector(3 * capacity, NULL);
     return ptr;
 }
 
@@ -88,35 +121,29 @@ static Thunk __id_impl(ClosureEnv env, int argc, Value** argv) {
 }
 
 Value* id;
+Value* nil;
 
-Thunk ApplyClosure(Value* f, int argc, Value** argv) {
+void apply_error(Value* f) {
     if (f == NULL) {
         fprintf(stderr, "ApplyClosure: NULL function pointer\n");
         runtime_error("ApplyClosure called with NULL");
     }
-    if (f->t != CLOSURE) {
-        fprintf(stderr, "ApplyClosure: expected CLOSURE, got %s\n", type_to_string(f->t));
+    if (value_tag(f) != CLOSURE) {
+        fprintf(stderr, "ApplyClosure: expected CLOSURE, got %s\n", type_to_string(value_tag(f)));
         runtime_error("ApplyClosure expects a closure");
     }
-    if (f->closure.lam == NULL) {
-        fprintf(stderr, "ApplyClosure: closure has NULL lambda pointer\n");
-        runtime_error("ApplyClosure: NULL lambda in closure");
-    }
-    return MakeThunk(f->closure.lam, f->closure.env, argc, argv);
+    fprintf(stderr, "ApplyClosure: closure has NULL lambda pointer\n");
+    runtime_error("ApplyClosure: NULL lambda in closure");
 }
 
 // ============ DEEP COPY ============
 Value* deep_copy(Value* v) {
-    if (v == NULL) return NULL;
+    KSU_STAT(deep_copy_nodes);
+    if (v == NULL || IS_IMMEDIATE(v)) return v;
     switch (v->t) {
-        case NUMBER:
-            return MakeInt(v->integer.value);
-        case BOOLEAN:
-            return MakeBool(v->boolean.value);
         case STRING:
-            return MakeString(strdup(v->string.value));
-        case NIL:
-            return MakeNil();
+            // Strings are immutable, so the character data can be shared.
+            return v;
         case PAIR:
             return MakePair(deep_copy(v->pair.first), deep_copy(v->pair.second));
         case CLOSURE:
@@ -125,376 +152,1106 @@ Value* deep_copy(Value* v) {
             runtime_error("please don't create box over box");
             return NULL;
         case SYMBOL:
-            return MakeSymbol(strdup(v->symbol.name));
+            // Symbols are interned
+            return v;
+        case FUTURE:
+            // A future only ever gets one value, so it can be shared
+            return v;
+        case VECTOR:
+        case HASHTABLE:
+            // Vectors and hash tables are mutable and shared by reference
+            return v;
         default:
             runtime_error("unknown type in deep_copy");
             return NULL;
     }
 }
 
-// ============ PAIR OPERATIONS ============
-static Thunk __builtin_fst(Value* v, Value* k) {
-    if (v == NULL) {
-        fprintf(stderr, "fst: NULL argument\n");
-        runtime_error("fst expects a pair");
-    }
-    if (v->t != PAIR) {
-        fprintf(stderr, "fst: expected PAIR, got type %d\n", v->t);
-        runtime_error("fst expects a pair");
-    }
-    if (v->pair.first == NULL) {
-        fprintf(stderr, "fst: first element is NULL\n");
-        runtime_error("first element of pair is null");
-    }
-    return ApplyClosure(k, 1, (Value*[]){ v->pair.first });
+// ============ SLOW PATHS ============
+// The inline __prim_* fast paths in ksu_runtime.h end up in one of these
+// out-of-line reporters whenever anything is unexpected.
+void __attribute__((noinline)) type_error(Value* v, const char* msg) {
+    if (v == NULL) fprintf(stderr, "%s; got NULL\n", msg);
+    else fprintf(stderr, "%s; got %s\n", msg, type_to_string(value_tag(v)));
+    runtime_error(msg);
 }
 
-static Thunk __builtin_snd(Value* v, Value* k) {
-    if (v == NULL) {
-        fprintf(stderr, "snd: NULL argument\n");
-        runtime_error("snd expects a pair");
-    }
-    if (v->t != PAIR) {
-        fprintf(stderr, "snd: expected PAIR, got type %d\n", v->t);
-        runtime_error("snd expects a pair");
-    }
-    if (v->pair.second == NULL) {
-        fprintf(stderr, "snd: second element is NULL\n");
-        runtime_error("second element of pair is null");
-    }
-    return ApplyClosure(k, 1, (Value*[]){ v->pair.second });
-}
-
-static Thunk __builtin_pair(Value* l, Value* r, Value* k) {
-    if (l == NULL || r == NULL) {
-        fprintf(stderr, "pair: NULL argument (l=%p, r=%p)\n", (void*)l, (void*)r);
-        runtime_error("pair expects non-NULL arguments");
+void __attribute__((noinline)) type_error2(Value* a, Value* b, const char* msg) {
+    if (a == NULL || b == NULL) {
+        fprintf(stderr, "%s: NULL argument (a=%p, b=%p)\n", msg, (void*)a, (void*)b);
+    } else {
+        fprintf(stderr, "%s; got %s and %s\n", msg, type_to_string(value_tag(a)), type_to_string(value_tag(b)));
     }
-    return ApplyClosure(k, 1, (Value*[]){ MakePair(l, r) });
+    runtime_error(msg);
 }
 
-Value* nil;
-
 // ============ TYPE PREDICATES ============
-static Thunk __builtin_is_pair(Value* v, Value* k) {
-    if (v == NULL) {
-        fprintf(stderr, "pair?: NULL argument\n");
-        runtime_error("pair? expects a value");
-    }
-    return ApplyClosure(k, 1, (Value*[]){ MakeBool(v->t == PAIR) });
-}
-
-static Thunk __builtin_is_nil(Value* v, Value* k) {
-    if (v == NULL) {
-        fprintf(stderr, "nil?: NULL argument\n");
-        runtime_error("nil? expects a value");
-    }
-    return ApplyClosure(k, 1, (Value*[]){ MakeBool(v->t == NIL) });
-}
-
-static Thunk __builtin_is_bool(Value* v, Value* k) {
-    if (v == NULL) {
-        fprintf(stderr, "bool?: NULL argument\n");
-        runtime_error("bool? expects a value");
-    }
-    return ApplyClosure(k, 1, (Value*[]){ MakeBool(v->t == BOOLEAN) });
-}
-
-static Thunk __builtin_is_number(Value* v, Value* k) {
-    if (v == NULL) {
-        fprintf(stderr, "number?: NULL argument\n");
-        runtime_error("number? expects a value");
-    }
-    return ApplyClosure(k, 1, (Value*[]){ MakeBool(v->t == NUMBER) });
-}
-
-static Thunk __builtin_is_list(Value* v, Value* k) {
-    if (v == NULL) {
-        fprintf(stderr, "list?: NULL argument\n");
-        runtime_error("list? expects a value");
-    }
+Value* __prim_is_list(Value* v) {
+    if (v == NULL) type_error(v, "list? expects a value");
     // A list is either nil or a pair whose second element is a list
     Value* cur = v;
-    while (cur->t == PAIR) {
+    while (value_tag(cur) == PAIR) {
         if (cur->pair.second == NULL) {
             fprintf(stderr, "list?: encountered NULL in pair chain\n");
             runtime_error("malformed list");
         }
         cur = cur->pair.second;
     }
-    return ApplyClosure(k, 1, (Value*[]){ MakeBool(cur->t == NIL) });
+    return MakeBool(cur == KSU_NIL);
 }
 
 // ============ COMPARISON ============
-static Thunk __builtin_eq(Value* a, Value* b, Value* k) {
-    if (a == NULL || b == NULL) {
-        fprintf(stderr, "eq: NULL argument (a=%p, b=%p)\n", (void*)a, (void*)b);
-        runtime_error("eq expects non-NULL arguments");
-    }
-    if (a->t != b->t) return ApplyClosure(k, 1, (Value*[]){ MakeBool(false) });
-    switch (a->t) {
+Value* __attribute__((noinline)) eq_slow(Value* a, Value* b) {
+    if (a == NULL || b == NULL) type_error2(a, b, "eq expects non-NULL arguments");
+    if (value_tag(a) != value_tag(b)) return MakeBool(false);
+    switch (value_tag(a)) {
         case NUMBER:
-            return ApplyClosure(k, 1, (Value*[]){ MakeBool(a->integer.value == b->integer.value) });
         case BOOLEAN:
-            return ApplyClosure(k, 1, (Value*[]){ MakeBool(a->boolean.value == b->boolean.value) });
+            return MakeBool(a == b);
         case STRING:
-            return ApplyClosure(k, 1, (Value*[]){ MakeBool(strcmp(a->string.value, b->string.value) == 0) });
+            return MakeBool(strcmp(a->string.value, b->string.value) == 0);
         case SYMBOL:
-            return ApplyClosure(k, 1, (Value*[]){ MakeBool(strcmp(a->symbol.name, b->symbol.name) == 0) });
+            return MakeBool(a == b);
         default:
             fprintf(stderr, "eq: can only compare ints and bools; got %s and %s\n",
-                    type_to_string(a->t), type_to_string(b->t));
+                    type_to_string(value_tag(a)), type_to_string(value_tag(b)));
             runtime_error("eq: unsupported types");
-            return DoneThunk(NULL);
     }
 }
 
-static Thunk __builtin_ne(Value* a, Value* b, Value* k) {
-    if (a == NULL || b == NULL) {
-        fprintf(stderr, "ne: NULL argument (a=%p, b=%p)\n", (void*)a, (void*)b);
-        runtime_error("ne expects non-NULL arguments");
-    }
-    if (a->t != b->t) return ApplyClosure(k, 1, (Value*[]){ MakeBool(true) });
-    switch (a->t) {
+Value* __attribute__((noinline)) ne_slow(Value* a, Value* b) {
+    if (a == NULL || b == NULL) type_error2(a, b, "ne expects non-NULL arguments");
+    if (value_tag(a) != value_tag(b)) return MakeBool(true);
+    switch (value_tag(a)) {
         case NUMBER:
-            return ApplyClosure(k, 1, (Value*[]){ MakeBool(a->integer.value != b->integer.value) });
         case BOOLEAN:
-            return ApplyClosure(k, 1, (Value*[]){ MakeBool(a->boolean.value != b->boolean.value) });
+        case SYMBOL:
+            return MakeBool(a != b);
         default:
             fprintf(stderr, "ne: can only compare ints and bools; got %s and %s\n",
-                    type_to_string(a->t), type_to_string(b->t));
+                    type_to_string(value_tag(a)), type_to_string(value_tag(b)));
             runtime_error("ne: unsupported types");
-            return DoneThunk(NULL);
     }
 }
 
 // ============ ARITHMETIC ============
-static void ensure_int_pair(Value* a, Value* b, const char* op) {
-    if (a == NULL || b == NULL) {
-        fprintf(stderr, "%s: NULL argument (a=%p, b=%p)\n", op, (void*)a, (void*)b);
-        runtime_error(op);
+void __attribute__((noinline)) division_by_zero(Value* a) {
+    fprintf(stderr, "division by zero: %d / 0\n", INT_VALUE(a));
+    runtime_error("division by zero");
+}
+
+void __attribute__((noinline)) index_error(Value* v, Value* i) {
+    fprintf(stderr, "vector index %d out of range for length %d\n", INT_VALUE(i), v->vector.length);
+    runtime_error("vector index out of range");
+}
+
+// ============ OUTPUT ============
+// print writes into one large buffer, which goes out in a single write(2) when
+// it fills up, before the program blocks on input, and at exit (ksu_init
+// registers output_at_exit). On a terminal every print is flushed right away.
+// The lock keeps values printed by different threads from interleaving.
+#define KSU_OUTPUT_BUFFER (1 << 20)
+
+static char output[KSU_OUTPUT_BUFFER];
+static size_t output_used = 0;
+static bool output_interactive = false;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void write_all(int fd, const char* p, size_t n) {
+    while (n > 0) {
+        ssize_t written = write(fd, p, n);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;  // stdout is gone, there is nowhere to report it
+        }
+        p += written;
+        n -= (size_t)written;
     }
-    if (a->t != NUMBER || b->t != NUMBER) {
-        fprintf(stderr, "%s; got %s and %s\n", op, type_to_string(a->t), type_to_string(b->t));
-        runtime_error(op);
+}
+
+static void output_flush(void) {
+    write_all(STDOUT_FILENO, output, output_used);
+    output_used = 0;
+}
+
+// Threads still running at exit may be printing; the exit does not wait for them
+static void output_at_exit(void) {
+    output_flush();
+}
+
+static void output_bytes(const char* p, size_t n) {
+    if (n > KSU_OUTPUT_BUFFER - output_used) {
+        output_flush();
+        if (n > KSU_OUTPUT_BUFFER) {
+            write_all(STDOUT_FILENO, p, n);
+            return;
+        }
     }
+    memcpy(output + output_used, p, n);
+    output_used += n;
 }
 
-static Thunk __builtin_add(Value* a, Value* b, Value* k) {
-    ensure_int_pair(a, b, "+ expects two integers");
-    return ApplyClosure(k, 1, (Value*[]){ MakeInt(a->integer.value + b->integer.value) });
+static void output_string(const char* s) {
+    output_bytes(s, strlen(s));
 }
 
-static Thunk __builtin_sub(Value* a, Value* b, Value* k) {
-    ensure_int_pair(a, b, "- expects two integers");
-    return ApplyClosure(k, 1, (Value*[]){ MakeInt(a->integer.value - b->integer.value) });
+static void output_int(int n) {
+    char digits[12];
+    int i = sizeof(digits);
+    unsigned int u = n < 0 ? -(unsigned int)n : (unsigned int)n;
+    do {
+        digits[--i] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    if (n < 0) digits[--i] = '-';
+    output_bytes(digits + i, sizeof(digits) - i);
 }
 
-static Thunk __builtin_mul(Value* a, Value* b, Value* k) {
-    ensure_int_pair(a, b, "* expects two integers");
-    return ApplyClosure(k, 1, (Value*[]){ MakeInt(a->integer.value * b->integer.value) });
+// print_value keeps what is left to print on an explicit stack instead of
+// recursing, so lists of any length print in constant C stack. An item is a
+// value, or a literal text when text is not NULL.
+typedef struct PrintItem {
+    Value* value;
+    const char* text;
+} PrintItem;
+
+static PrintItem* print_stack = NULL;
+static size_t print_capacity = 0;
+
+static void print_push(size_t* top, Value* value, const char* text) {
+    if (*top == print_capacity) {
+        print_capacity = print_capacity == 0 ? 64 : 2 * print_capacity;
+        print_stack = realloc(print_stack, sizeof(PrintItem) * print_capacity);
+        if (print_stack == NULL) runtime_error("print: out of memory");
+    }
+    print_stack[(*top)++] = (PrintItem){ value, text };
 }
 
-static Thunk __builtin_div(Value* a, Value* b, Value* k) {
-    ensure_int_pair(a, b, "/ expects two integers");
-    if (b->integer.value == 0) {
-        fprintf(stderr, "division by zero: %d / 0\n", a->integer.value);
-        runtime_error("division by zero");
+static void print_value(Value* root) {
+    size_t top = 0;
+    print_push(&top, root, NULL);
+    while (top > 0) {
+        PrintItem item = print_stack[--top];
+        if (item.text != NULL) {
+            output_string(item.text);
+            continue;
+        }
+        Value* v = item.value;
+        if (v == NULL) {
+            output_string("NULL");
+            continue;
+        }
+        switch (value_tag(v)) {
+            case NUMBER:
+                output_int(INT_VALUE(v));
+                break;
+            case BOOLEAN:
+                output_string(BOOL_VALUE(v) ? "#t" : "#f");
+                break;
+            case STRING:
+                output_string("\"");
+                output_string(v->string.value);
+                output_string("\"");
+                break;
+            case NIL:
+                output_string("nil");
+                break;
+            case PAIR:
+                // The rest of a list waits under its first element, so a long
+                // list takes the same few items at every step
+                print_push(&top, v->pair.second, NULL);
+                print_push(&top, NULL, " . ");
+                print_push(&top, v->pair.first, NULL);
+                break;
+            case CLOSURE:
+                output_string("<closure>");
+                break;
+            case BOX:
+                output_string("(box ");
+                print_push(&top, NULL, ")");
+                print_push(&top, v->box.ptr, NULL);
+                break;
+            case SYMBOL:
+                output_string("'");
+                output_string(v->symbol.name);
+                break;
+            case FUTURE:
+                output_string("<future>");
+                break;
+            case VECTOR:
+                output_string("#(");
+                print_push(&top, NULL, ")");
+                for (int i = v->vector.length - 1; i >= 0; i--) {
+                    print_push(&top, v->vector.items[i], NULL);
+                    if (i > 0) print_push(&top, NULL, " ");
+                }
+                break;
+            case HASHTABLE:
+                output_string("<hashtable>");
+                break;
+            default: {
+                char unknown[32];
+                snprintf(unknown, sizeof(unknown), "<unknown-type-%d>", value_tag(v));
+                output_string(unknown);
+            }
+        }
     }
-    return ApplyClosure(k, 1, (Value*[]){ MakeInt(a->integer.value / b->integer.value) });
 }
 
-static Thunk __builtin_lt(Value* a, Value* b, Value* k) {
-    ensure_int_pair(a, b, "< expects two integers");
-    return ApplyClosure(k, 1, (Value*[]){ MakeBool(a->integer.value < b->integer.value) });
+Value* __prim_print(Value* a) {
+    pthread_mutex_lock(&output_lock);
+    print_value(a);
+    output_bytes("\n", 1);
+    if (output_interactive) output_flush();
+    pthread_mutex_unlock(&output_lock);
+    return KSU_NIL;
 }
 
-static Thunk __builtin_gt(Value* a, Value* b, Value* k) {
-    ensure_int_pair(a, b, "> expects two integers");
-    return ApplyClosure(k, 1, (Value*[]){ MakeBool(a->integer.value > b->integer.value) });
+// ============ INPUT ============
+// stdin is read through one buffer: a regular file is mapped whole with mmap,
+// anything else (pipes, terminals) is read in large blocks, so the read
+// builtins scan memory instead of making a call per character. The unread
+// input is input[input_pos .. input_end).
+//
+// Futures may read too, so every read builtin holds input_lock while it uses
+// the buffer. A thread that waits for input, or for the lock, does not reach
+// a safepoint: until the input arrives, a collection that another thread asks
+// for waits as well.
+#define KSU_INPUT_BLOCK (1 << 20)
+
+static char* input = NULL;
+static size_t input_pos = 0;
+static size_t input_end = 0;
+static size_t input_capacity = 0;
+static bool input_mapped = false;
+static bool input_eof = false;
+static pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void input_open(void) {
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+        if (p != MAP_FAILED) {
+            // stdin may have been handed over partway through the file
+            off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+            madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+            input = p;
+            input_pos = offset > 0 && offset <= st.st_size ? (size_t)offset : 0;
+            input_end = (size_t)st.st_size;
+            input_mapped = true;
+            return;
+        }
+    }
+    input_capacity = KSU_INPUT_BLOCK;
+    input = malloc(input_capacity);
+    if (input == NULL) runtime_error("input: out of memory");
 }
 
-static Thunk __builtin_le(Value* a, Value* b, Value* k) {
-    ensure_int_pair(a, b, "<= expects two integers");
-    return ApplyClosure(k, 1, (Value*[]){ MakeBool(a->integer.value <= b->integer.value) });
+// Reads more input after the unread part; false at the end of input
+static bool input_fill(void) {
+    if (input == NULL) {
+        input_open();
+        if (input_mapped) return input_pos < input_end;
+    }
+    if (input_mapped || input_eof) return false;
+
+    // Whatever was printed so far, like a prompt, shows up before the program waits
+    pthread_mutex_lock(&output_lock);
+    output_flush();
+    pthread_mutex_unlock(&output_lock);
+
+    size_t unread = input_end - input_pos;
+    memmove(input, input + input_pos, unread);
+    input_pos = 0;
+    input_end = unread;
+    if (input_end == input_capacity) {
+        // A line longer than the buffer
+        input_capacity *= 2;
+        input = realloc(input, input_capacity);
+        if (input == NULL) runtime_error("input: out of memory");
+    }
+    ssize_t n;
+    do {
+        n = read(STDIN_FILENO, input + input_end, input_capacity - input_end);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        input_eof = true;
+        return false;
+    }
+    input_end += (size_t)n;
+    return true;
 }
 
-static Thunk __builtin_ge(Value* a, Value* b, Value* k) {
-    ensure_int_pair(a, b, ">= expects two integers");
-    return ApplyClosure(k, 1, (Value*[]){ MakeBool(a->integer.value >= b->integer.value) });
+static int input_peek(void) {
+    if (input_pos == input_end && !input_fill()) return EOF;
+    return (unsigned char)input[input_pos];
 }
 
-// ============ BOOLEAN OPERATIONS ============
-static Thunk __builtin_and(Value* a, Value* b, Value* k) {
-    if (a == NULL || b == NULL) {
-        fprintf(stderr, "and: NULL argument (a=%p, b=%p)\n", (void*)a, (void*)b);
-        runtime_error("and expects non-NULL arguments");
-    }
-    if (a->t != BOOLEAN || b->t != BOOLEAN) {
-        fprintf(stderr, "and: expects booleans; got %s and %s\n",
-                type_to_string(a->t), type_to_string(b->t));
-        runtime_error("and expects two booleans");
+// The next line without its line break, or nil at the end of input
+static Value* read_line(void) {
+    size_t scanned = 0;
+    for (;;) {
+        if (input != NULL) {
+            char* start = input + input_pos;
+            char* newline = memchr(start + scanned, '\n', input_end - input_pos - scanned);
+            if (newline != NULL) {
+                size_t length = (size_t)(newline - start);
+                input_pos += length + 1;
+                if (length > 0 && start[length - 1] == '\r') length--;
+                return MakeStringCopy(start, length);
+            }
+            scanned = input_end - input_pos;
+        }
+        if (!input_fill()) break;
     }
-    return ApplyClosure(k, 1, (Value*[]){ MakeBool(a->boolean.value && b->boolean.value) });
+    if (input_pos == input_end) return KSU_NIL;
+    // The last line has no line break
+    size_t length = input_end - input_pos;
+    input_pos = input_end;
+    return MakeStringCopy(input + input_pos - length, length);
 }
 
-static Thunk __builtin_or(Value* a, Value* b, Value* k) {
-    if (a == NULL || b == NULL) {
-        fprintf(stderr, "or: NULL argument (a=%p, b=%p)\n", (void*)a, (void*)b);
-        runtime_error("or expects non-NULL arguments");
+// The next integer after any whitespace, or nil at the end of input
+static Value* read_number(void) {
+    int c = input_peek();
+    while (c != EOF && isspace(c)) {
+        input_pos++;
+        c = input_peek();
     }
-    if (a->t != BOOLEAN || b->t != BOOLEAN) {
-        fprintf(stderr, "or: expects booleans; got %s and %s\n",
-                type_to_string(a->t), type_to_string(b->t));
-        runtime_error("or expects two booleans");
+    if (c == EOF) return KSU_NIL;
+    bool negative = c == '-';
+    if (negative) {
+        input_pos++;
+        c = input_peek();
     }
-    return ApplyClosure(k, 1, (Value*[]){ MakeBool(a->boolean.value || b->boolean.value) });
+    if (c == EOF || !isdigit(c)) runtime_error("read-number: the input is not a number");
+    // Numbers are C ints, and INT_MIN has no positive counterpart
+    unsigned int limit = negative ? -(unsigned int)INT_MIN : (unsigned int)INT_MAX;
+    unsigned int n = 0;
+    while (c != EOF && isdigit(c)) {
+        unsigned int digit = (unsigned int)(c - '0');
+        if (n > (limit - digit) / 10) runtime_error("read-number: the number is out of range");
+        n = 10 * n + digit;
+        input_pos++;
+        c = input_peek();
+    }
+    return MakeInt(negative ? (int)-n : (int)n);
 }
 
-static Thunk __builtin_not(Value* a, Value* k) {
-    if (a == NULL) {
-        fprintf(stderr, "not: NULL argument\n");
-        runtime_error("not expects a value");
+// The rest of the input as one string
+static Value* read_all(void) {
+    while (input_fill()) {
     }
-    if (a->t != BOOLEAN) {
-        fprintf(stderr, "not: expects boolean; got %s\n", type_to_string(a->t));
-        runtime_error("not expects a boolean");
+    size_t length = input_end - input_pos;
+    Value* all = MakeStringCopy(input == NULL ? "" : input + input_pos, length);
+    input_pos = input_end;
+    return all;
+}
+
+Value* __prim_read_line(void) {
+    pthread_mutex_lock(&input_lock);
+    Value* line = read_line();
+    pthread_mutex_unlock(&input_lock);
+    return line;
+}
+
+Value* __prim_read_number(void) {
+    pthread_mutex_lock(&input_lock);
+    Value* number = read_number();
+    pthread_mutex_unlock(&input_lock);
+    return number;
+}
+
+Value* __prim_read_all(void) {
+    pthread_mutex_lock(&input_lock);
+    Value* all = read_all();
+    pthread_mutex_unlock(&input_lock);
+    return all;
+}
+
+// ============ VECTORS ============
+Value* __prim_make_vector(Value* n, Value* fill) {
+    if (!IS_FIXNUM(n) || INT_VALUE(n) < 0 || fill == NULL) {
+        type_error2(n, fill, "make-vector expects a non-negative length and a value");
     }
-    return ApplyClosure(k, 1, (Value*[]){ MakeBool(!a->boolean.value) });
+    return MakeVector(INT_VALUE(n), fill);
 }
 
-// ============ I/O ============
-static void print_value(Value* v) {
-    if (v == NULL) {
-        printf("NULL");
-        return;
+Value* __prim_vector_to_list(Value* v) {
+    if (!IS_HEAP(v, VECTOR)) type_error(v, "vector->list expects a vector");
+    Value* list = MakeNil();
+    for (int i = v->vector.length - 1; i >= 0; i--) {
+        list = MakePair(v->vector.items[i], list);
     }
-    switch (v->t) {
-        case NUMBER:
-            printf("%d", v->integer.value);
-            break;
-        case BOOLEAN:
-            printf("%s", v->boolean.value ? "#t" : "#f");
-            break;
-        case STRING:
-            printf("\"%s\"", v->string.value);
-            break;
-        case NIL:
-            printf("nil");
-            break;
-        case PAIR:
-            print_value(v->pair.first);
-            printf(" . ");
-            print_value(v->pair.second);
-            break;
-        case CLOSURE:
-            printf("<closure>");
-            break;
-        case BOX:
-            printf("(box ");
-            print_value(v->box.ptr);
-            printf(")");
-            break;
-        case SYMBOL:
-            printf("'%s", v->symbol.name);
-            break;
-        default:
-            printf("<unknown-type-%d>", v->t);
+    return list;
+}
+
+Value* __prim_list_to_vector(Value* l) {
+    int length = 0;
+    for (Value* p = l; p != KSU_NIL; p = p->pair.second) {
+        if (!IS_HEAP(p, PAIR)) type_error(l, "list->vector expects a list");
+        length++;
+    }
+    Value* v = MakeVector(length, KSU_NIL);
+    Value* p = l;
+    for (int i = 0; i < length; i++, p = p->pair.second) {
+        v->vector.items[i] = p->pair.first;
     }
+    return v;
 }
 
-static Thunk __builtin_print(Value* a, Value* k) {
-    print_value(a);
-    printf("\n");
-    return ApplyClosure(k, 1, (Value*[]){ MakeNil() });
+// ============ HASH TABLES ============
+#define HASHTABLE_MIN_CAPACITY 8
+
+// FNV-1a of a string, fitting a fixnum
+static int hash_string(const char* s) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (; *s; s++) h = (h ^ (unsigned char)*s) * 0x100000001b3ull;
+    return (int)(h & 0x3fffffff);
 }
 
-// ============ BOX OPERATIONS ============
-static Thunk __builtin_box(Value* v, Value* k) {
-    if (v == NULL) {
-        fprintf(stderr, "box: NULL argument\n");
-        runtime_error("box expects a value");
+// Numbers and booleans are mixed with a multiplicative hash, symbols carry
+// theirs. Equal keys in the sense of eq_slow always get equal hashes.
+static int hash_key(Value* key) {
+    if (IS_IMMEDIATE(key)) {
+        uint64_t h = (uint64_t)(intptr_t)key * 0x9e3779b97f4a7c15ull;
+        return (int)((h ^ (h >> 32)) & 0x3fffffff);
     }
-    return ApplyClosure(k, 1, (Value*[]){ MakeBox(v) });
+    if (key != NULL && key->t == STRING) return hash_string(key->string.value);
+    if (key != NULL && key->t == SYMBOL) return key->symbol.hash;
+    type_error(key, "hash table keys must be numbers, booleans, strings or symbols");
 }
 
-static Thunk __builtin_set(Value* box, Value* value, Value* k) {
-    if (box == NULL || value == NULL) {
-        fprintf(stderr, "set!: NULL argument (box=%p, value=%p)\n", (void*)box, (void*)value);
-        runtime_error("set! expects non-NULL arguments");
-    }
-    if (box->t != BOX) {
-        fprintf(stderr, "set!: expects box; got %s\n", type_to_string(box->t));
-        runtime_error("set! expects a box");
-    }
-    box->box.ptr = deep_copy(value);
-    return ApplyClosure(k, 1, (Value*[]){ MakeNil() });
+// Different symbols are never equal
+static bool keys_equal(Value* a, Value* b) {
+    if (a == b) return true;
+    if (IS_IMMEDIATE(a) || IS_IMMEDIATE(b) || a->t != STRING || b->t != STRING) return false;
+    return strcmp(a->string.value, b->string.value) == 0;
+}
+
+static inline int hashtable_capacity(Value* table) {
+    return table->hashtable.entries->vector.length / 3;
 }
 
-static Thunk __builtin_unwrap(Value* box, Value* k) {
-    if (box == NULL) {
-        fprintf(stderr, "unwrap: NULL argument\n");
-        runtime_error("unwrap expects a box");
+// Index of the entry holding key, or of the free entry where it would go
+static int hashtable_find(Value* table, Value* key, int hash) {
+    Value** e = table->hashtable.entries->vector.items;
+    int mask = hashtable_capacity(table) - 1;
+    for (int i = hash & mask;; i = (i + 1) & mask) {
+        Value* k = e[3 * i + 1];
+        if (k == NULL || (e[3 * i] == MakeInt(hash) && keys_equal(k, key))) return i;
     }
-    if (box->t != BOX) {
-        fprintf(stderr, "unwrap: expects box; got %s\n", type_to_string(box->t));
-        runtime_error("unwrap expects a box");
+}
+
+static void hashtable_grow(Value* table) {
+    Value* old = table->hashtable.entries;
+    table->hashtable.entries = MakeVector(2 * old->vector.length, NULL);
+    for (int i = 0; i < old->vector.length; i += 3) {
+        Value* key = old->vector.items[i + 1];
+        if (key == NULL) continue;
+        int j = hashtable_find(table, key, INT_VALUE(old->vector.items[i]));
+        memcpy(&table->hashtable.entries->vector.items[3 * j], &old->vector.items[i], 3 * sizeof(Value*));
     }
-    if (box->box.ptr == NULL) {
-        fprintf(stderr, "unwrap: box contains NULL pointer\n");
-        runtime_error("unwrap: box is empty");
+}
+
+static void check_hashtable(Value* table, const char* msg) {
+    if (!IS_HEAP(table, HASHTABLE)) type_error(table, msg);
+}
+
+Value* __prim_make_hashtable(void) {
+    return MakeHashtable(HASHTABLE_MIN_CAPACITY);
+}
+
+Value* __prim_hashtable_ref(Value* table, Value* key, Value* otherwise) {
+    check_hashtable(table, "hashtable-ref expects a hash table");
+    int i = hashtable_find(table, key, hash_key(key));
+    Value** e = table->hashtable.entries->vector.items;
+    return e[3 * i + 1] != NULL ? e[3 * i + 2] : otherwise;
+}
+
+Value* __prim_hashtable_contains(Value* table, Value* key) {
+    check_hashtable(table, "hashtable-contains? expects a hash table");
+    int i = hashtable_find(table, key, hash_key(key));
+    return MakeBool(table->hashtable.entries->vector.items[3 * i + 1] != NULL);
+}
+
+Value* __prim_hashtable_set(Value* table, Value* key, Value* value) {
+    check_hashtable(table, "hashtable-set! expects a hash table");
+    if (value == NULL) type_error(value, "hashtable-set! expects a value");
+    int hash = hash_key(key);
+    int i = hashtable_find(table, key, hash);
+    Value** e = table->hashtable.entries->vector.items;
+    if (e[3 * i + 1] == NULL) {
+        // A new key: keep the load factor at or below 3/4
+        if (4 * (table->hashtable.count + 1) > 3 * hashtable_capacity(table)) {
+            hashtable_grow(table);
+            i = hashtable_find(table, key, hash);
+            e = table->hashtable.entries->vector.items;
+        }
+        e[3 * i] = MakeInt(hash);
+        e[3 * i + 1] = key;
+        table->hashtable.count++;
     }
-    return ApplyClosure(k, 1, (Value*[]){ deep_copy(box->box.ptr) });
+    e[3 * i + 2] = value;
+    return MakeNil();
 }
 
-static Thunk __builtin_peek(Value* box, Value* k) {
-    if (box == NULL) {
-        fprintf(stderr, "peek: NULL argument\n");
-        runtime_error("peek expects a box");
+Value* __prim_hashtable_delete(Value* table, Value* key) {
+    check_hashtable(table, "hashtable-delete! expects a hash table");
+    int i = hashtable_find(table, key, hash_key(key));
+    Value** e = table->hashtable.entries->vector.items;
+    if (e[3 * i + 1] == NULL) return MakeNil();
+    table->hashtable.count--;
+    // Move back every following entry whose home slot is not between the
+    // hole and itself, so that lookups never stop early at the hole
+    int mask = hashtable_capacity(table) - 1;
+    for (int j = (i + 1) & mask; e[3 * j + 1] != NULL; j = (j + 1) & mask) {
+        int home = INT_VALUE(e[3 * j]) & mask;
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (stays) continue;
+        memcpy(&e[3 * i], &e[3 * j], 3 * sizeof(Value*));
+        i = j;
     }
-    if (box->t != BOX) {
-        fprintf(stderr, "peek: expects box; got %s\n", type_to_string(box->t));
-        runtime_error("peek expects a box");
+    e[3 * i] = NULL;
+    e[3 * i + 1] = NULL;
+    e[3 * i + 2] = NULL;
+    return MakeNil();
+}
+
+Value* __prim_hashtable_keys(Value* table) {
+    check_hashtable(table, "hashtable-keys expects a hash table");
+    Value* entries = table->hashtable.entries;
+    Value* list = MakeNil();
+    for (int i = entries->vector.length - 3; i >= 0; i -= 3) {
+        if (entries->vector.items[i + 1] != NULL) list = MakePair(entries->vector.items[i + 1], list);
     }
-    if (box->box.ptr == NULL) {
-        fprintf(stderr, "peek: box contains NULL pointer\n");
-        runtime_error("peek: box is empty");
+    return list;
+}
+
+// Every entry as a (key . value) pair
+Value* __prim_hashtable_to_list(Value* table) {
+    check_hashtable(table, "hashtable->list expects a hash table");
+    Value* entries = table->hashtable.entries;
+    Value* list = MakeNil();
+    for (int i = entries->vector.length - 3; i >= 0; i -= 3) {
+        Value** e = &entries->vector.items[i];
+        if (e[1] != NULL) list = MakePair(MakePair(e[1], e[2]), list);
     }
-    return ApplyClosure(k, 1, (Value*[]){ box->box.ptr });
+    return list;
 }
 
-static Thunk __builtin_string_to_symbol(Value* v, Value* k) {
-    if (v == NULL) {
-        fprintf(stderr, "string->symbol: NULL argument\n");
-        runtime_error("string->symbol expects a string");
+// ============ SYMBOLS ============
+// The symbol table is an open-addressing set of every symbol created so far.
+// Generated code interns its symbol literals once at startup, so the lock is
+// only taken again by string->symbol.
+static pthread_mutex_t symbols_lock = PTHREAD_MUTEX_INITIALIZER;
+static Value** symbols = NULL;
+static int symbols_capacity = 0;
+static int symbols_count = 0;
+
+static void symbols_grow(void) {
+    Value** old = symbols;
+    int old_capacity = symbols_capacity;
+    symbols_capacity = old_capacity ? 2 * old_capacity : 256;
+    symbols = (Value**)calloc(symbols_capacity, sizeof(Value*));
+    if (symbols == NULL) runtime_error("symbol table: out of memory");
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i] == NULL) continue;
+        int j = old[i]->symbol.hash & (symbols_capacity - 1);
+        while (symbols[j] != NULL) j = (j + 1) & (symbols_capacity - 1);
+        symbols[j] = old[i];
     }
-    if (v->t != STRING) {
-        fprintf(stderr, "string->symbol: expects string; got %s\n", type_to_string(v->t));
-        runtime_error("string->symbol expects a string");
+    free(old);
+}
+
+Value* MakeSymbol(const char* name) {
+    int hash = hash_string(name);
+    pthread_mutex_lock(&symbols_lock);
+    if (4 * (symbols_count + 1) > 3 * symbols_capacity) symbols_grow();
+    int i = hash & (symbols_capacity - 1);
+    for (; symbols[i] != NULL; i = (i + 1) & (symbols_capacity - 1)) {
+        Value* sym = symbols[i];
+        if (sym->symbol.hash == hash && strcmp(sym->symbol.name, name) == 0) {
+            pthread_mutex_unlock(&symbols_lock);
+            return sym;
+        }
     }
-    return ApplyClosure(k, 1, (Value*[]){ MakeSymbol(v->string.value) });
+    Value* ptr = gc_alloc(GC_VALUE, sizeof(Value));
+    KSU_STAT(allocs[SYMBOL]);
+    ptr->symbol.t = SYMBOL;
+    ptr->symbol.hash = hash;
+    ptr->symbol.name = strdup(name);
+    symbols[i] = ptr;
+    symbols_count++;
+    pthread_mutex_unlock(&symbols_lock);
+    return ptr;
 }
 
-static Thunk __builtin_is_symbol(Value* v, Value* k) {
-    if (v == NULL) {
-        fprintf(stderr, "symbol?: NULL argument\n");
-        runtime_error("symbol? expects a value");
+static void scan_symbols(void) {
+    for (int i = 0; i < symbols_capacity; i++) {
+        if (symbols[i] != NULL) gc_mark(symbols[i]);
     }
-    return ApplyClosure(k, 1, (Value*[]){ MakeBool(v->t == SYMBOL) });
 }
 
-static Thunk __builtin_raise(Value* v, Value* k) {
-    (void)k;
+Value* __prim_string_to_symbol(Value* v) {
+    if (!IS_HEAP(v, STRING)) type_error(v, "string->symbol expects a string");
+    return MakeSymbol(v->string.value);
+}
+
+// ============ CONTROL ============
+// Primitives that need the continuation itself are called in CPS.
+Value* __prim_raise(Value* v) {
     fprintf(stderr, "Error: ");
     if (v == NULL) {
         fprintf(stderr, "(null)\n");
-    } else if (v->t == STRING) {
+    } else if (value_tag(v) == STRING) {
         fprintf(stderr, "%s\n", v->string.value);
-    } else if (v->t == SYMBOL) {
+    } else if (value_tag(v) == SYMBOL) {
         fprintf(stderr, "%s\n", v->symbol.name);
     } else {
-        fprintf(stderr, "<value of type %s>\n", type_to_string(v->t));
+        fprintf(stderr, "<value of type %s>\n", type_to_string(value_tag(v)));
     }
     exit(1);
-    return DoneThunk(NULL);
+}
+
+Thunk __builtin_raise(Value* v, Value* k) {
+    (void)k;
+    __prim_raise(v);
+}
+
+// ============ TASKS ============
+// Green threads. A task is a closure waiting to be called with one argument:
+// a freshly spawned thunk (called with the task exit continuation) or the
+// CPS continuation of a task that yielded (called with nil). Runnable tasks
+// sit in a ring buffer, so a context switch is one enqueue plus one thunk.
+// The scheduler belongs to the main thread; futures cannot use it.
+typedef struct Task {
+    Value* fn;
+    Value* arg;
+} Task;
+
+static Task* task_queue = NULL;
+static int task_head = 0;
+static int task_count = 0;
+static int task_capacity = 0;  // always a power of two
+
+// Continuation of the running run-scheduler, resumed once the queue drains
+static Value* scheduler_k = NULL;
+static Value* task_exit;
+
+static void task_push(Value* fn, Value* arg) {
+    if (task_count == task_capacity) {
+        int capacity = task_capacity ? task_capacity * 2 : 64;
+        Task* queue = (Task*)malloc(sizeof(Task) * capacity);
+        if (!queue) runtime_error("spawn: out of memory");
+        for (int i = 0; i < task_count; i++) {
+            queue[i] = task_queue[(task_head + i) & (task_capacity - 1)];
+        }
+        free(task_queue);
+        task_queue = queue;
+        task_head = 0;
+        task_capacity = capacity;
+    }
+    task_queue[(task_head + task_count) & (task_capacity - 1)] = (Task){ fn, arg };
+    task_count++;
+}
+
+static void scan_tasks(void) {
+    for (int i = 0; i < task_count; i++) {
+        Task* task = &task_queue[(task_head + i) & (task_capacity - 1)];
+        gc_mark(task->fn);
+        gc_mark(task->arg);
+    }
+}
+
+// Switches to the next runnable task. With nothing left to run, control goes
+// back to run-scheduler, or ends the current top-level expression.
+static Thunk run_next_task(void) {
+    if (task_count > 0) {
+        Task task = task_queue[task_head];
+        task_head = (task_head + 1) & (task_capacity - 1);
+        task_count--;
+        return ApplyClosure(task.fn, 1, (Value*[]){ task.arg });
+    }
+    if (scheduler_k != NULL) {
+        Value* k = scheduler_k;
+        scheduler_k = NULL;
+        return ApplyClosure(k, 1, (Value*[]){ MakeNil() });
+    }
+    return DoneThunk(MakeNil());
+}
+
+static Thunk __task_exit_impl(ClosureEnv env, int argc, Value** argv) {
+    (void)env; (void)argc; (void)argv;
+    return run_next_task();
+}
+
+static void check_main_thread(const char* msg) {
+    if (ksu_on_worker()) runtime_error(msg);
+}
+
+Value* __prim_spawn(Value* thunk) {
+    check_main_thread("spawn: tasks only run on the main thread");
+    if (!IS_HEAP(thunk, CLOSURE)) type_error(thunk, "spawn expects a function");
+    task_push(thunk, task_exit);
+    return MakeNil();
+}
+
+Thunk __builtin_spawn(Value* thunk, Value* k) {
+    return ApplyClosure(k, 1, (Value*[]){ __prim_spawn(thunk) });
+}
+
+Thunk __builtin_yield(Value* k) {
+    check_main_thread("yield: tasks only run on the main thread");
+    task_push(k, MakeNil());
+    return run_next_task();
+}
+
+Thunk __builtin_run_scheduler(Value* k) {
+    check_main_thread("run-scheduler: tasks only run on the main thread");
+    if (scheduler_k != NULL) runtime_error("run-scheduler: the scheduler is already running");
+    scheduler_k = k;
+    return run_next_task();
+}
+
+// ============ FUTURES ============
+// (future thunk) returns at once and queues the future as a job for the
+// worker pool. The thunk runs on whichever thread claims the future first:
+// a worker, or the first thread that touches it. Claiming is a
+// compare-and-swap from pending to running, so every thunk runs once.
+enum { FUTURE_PENDING, FUTURE_RUNNING, FUTURE_DONE };
+
+static bool future_claim(Value* f) {
+    int expected = FUTURE_PENDING;
+    return atomic_compare_exchange_strong(&f->future.state, &expected, FUTURE_RUNNING);
+}
+
+static void future_resolve(Value* f, Value* v) {
+    f->future.value = v;
+    f->future.thunk = NULL;
+    atomic_store_explicit(&f->future.state, FUTURE_DONE, memory_order_release);
+}
+
+// Worker job. The worker runs the thunk on its own trampoline.
+static void run_future(Value* f) {
+    if (!future_claim(f)) return;
+    future_resolve(f, Trampoline(ApplyClosure(f->future.thunk, 1, (Value*[]){ id })));
+}
+
+Value* __prim_future(Value* thunk) {
+    if (!IS_HEAP(thunk, CLOSURE)) type_error(thunk, "future expects a function");
+    ksu_start_workers(run_future);
+    Value* f = MakeFuture(thunk);
+    ksu_push_job(f);
+    return f;
+}
+
+static const char* const future_k_names[] = { "future", "k" };
+
+// Continuation of a future that runs in the thread that touched it
+static Thunk __future_resolve_impl(ClosureEnv env, int argc, Value** argv) {
+    (void)argc;
+    future_resolve(env->slots[0], argv[0]);
+    return ApplyClosure(env->slots[1], 1, argv);
+}
+
+static Thunk __touch_again_impl(ClosureEnv env, int argc, Value** argv) {
+    (void)env; (void)argc;
+    return __builtin_touch(argv[0], argv[1]);
+}
+
+Thunk __builtin_touch(Value* f, Value* k) {
+    if (!IS_HEAP(f, FUTURE)) type_error(f, "touch expects a future");
+    int state = atomic_load_explicit(&f->future.state, memory_order_acquire);
+    if (state == FUTURE_DONE) {
+        return ApplyClosure(k, 1, (Value*[]){ f->future.value });
+    }
+    if (state == FUTURE_PENDING && future_claim(f)) {
+        Value* resolve_k = MakeClosure(__future_resolve_impl, MakeEnv(2, future_k_names, (Value*[]){ f, k }));
+        return ApplyClosure(f->future.thunk, 1, (Value*[]){ resolve_k });
+    }
+    // Another thread is running it. Wait by bouncing on the trampoline, so
+    // that a collection can still stop this thread.
+    sched_yield();
+    return MakeThunk(__touch_again_impl, NULL, 2, (Value*[]){ f, k });
+}
+
+// Direct-style code waits on a trampoline of its own
+Value* __prim_touch(Value* f) {
+    return Trampoline(__builtin_touch(f, id));
+}
+
+// ============ DIRECT STYLE ============
+// Direct-style code calls closures through their CPS entry, with id as the
+// continuation. A direct-style callee returns by calling id at once, which is
+// taken apart here; any other thunk is CPS code, which the compiler has made
+// sure cannot capture a continuation, and runs on a trampoline of its own.
+Value* ApplyDirect(Value* f, int argc, Value** argv) {
+    if (f == NULL || IS_IMMEDIATE(f) || f->t != CLOSURE || f->closure.lam == NULL) apply_error(f);
+#ifdef KSU_STATS
+    ksu_stats_apply(f->closure.lam);
+#endif
+    Value* inline_args[THUNK_INLINE_ARGS];
+    Value** args = argc < THUNK_INLINE_ARGS ? inline_args : (Value**)ksu_alloc(sizeof(Value*) * (argc + 1));
+    memcpy(args, argv, sizeof(Value*) * argc);
+    args[argc] = id;
+    // Direct calls in the callee return thunks instead of dropping our stack
+    char* stack_base = ksu_stack_base;
+    Lambda_t func = ksu_current_func;
+    ksu_stack_base = NULL;
+    Thunk t = f->closure.lam(f->closure.env, argc + 1, args);
+    ksu_stack_base = stack_base;
+    if (args != inline_args) ksu_free(args);
+    Value* result = t.func == __id_impl ? thunk_args(&t)[0] : Trampoline(t);
+    ksu_current_func = func;
+    return result;
+}
+
+// ============ SOURCE MAP ============
+// Emitted by ksu for every program; the runtime's own functions are listed here
+extern const KsuSourceInfo ksu_source_map[] __attribute__((weak));
+extern const char* const ksu_source_file __attribute__((weak));
+
+static const KsuSourceInfo runtime_sources[] = {
+    { __id_impl, "id", "runtime", "id", 0 },
+    { __task_exit_impl, "task_exit", "runtime", "task_exit", 0 },
+    { __future_resolve_impl, "future_resolve", "runtime", "future_resolve", 0 },
+    { __touch_again_impl, "touch_again", "runtime", "touch_again", 0 },
+    { NULL, NULL, NULL, NULL, 0 },
+};
+
+static const KsuSourceInfo* source_info(Lambda_t f) {
+    for (const KsuSourceInfo* s = runtime_sources; s->f != NULL; s++) {
+        if (s->f == f) return s;
+    }
+    if (ksu_source_map != NULL) {
+        for (const KsuSourceInfo* s = ksu_source_map; s->f != NULL; s++) {
+            if (s->f == f) return s;
+        }
+    }
+    return NULL;
+}
+
+void ksu_report_location(void) {
+    const KsuSourceInfo* info = source_info(ksu_current_func);
+    if (info == NULL || info->line == 0) return;
+    fprintf(stderr, "  at %s (%s:%d)\n", info->description,
+            &ksu_source_file != NULL ? ksu_source_file : "?", info->line);
+}
+
+// Counts per function, in an open-addressing table keyed by the function
+// pointer. Adding is lock-free, so it is safe from signal handlers and
+// worker threads alike; functions that no longer fit are dropped.
+#define FUNC_TABLE_SIZE 4096
+
+typedef struct FuncCount {
+    Lambda_t f;
+    unsigned long count;
+} FuncCount;
+
+static void func_count_add(FuncCount* table, Lambda_t f) {
+    size_t i = ((uintptr_t)f >> 4) & (FUNC_TABLE_SIZE - 1);
+    for (int probes = 0; probes < FUNC_TABLE_SIZE; probes++, i = (i + 1) & (FUNC_TABLE_SIZE - 1)) {
+        Lambda_t cur = __atomic_load_n(&table[i].f, __ATOMIC_RELAXED);
+        if (cur == NULL && __atomic_compare_exchange_n(&table[i].f, &cur, f, false,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            cur = f;
+        }
+        if (cur == f) {
+            __atomic_fetch_add(&table[i].count, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+static int by_count(const void* a, const void* b) {
+    unsigned long x = ((const FuncCount*)a)->count, y = ((const FuncCount*)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Copies the used entries of table to out, largest count first
+static int func_counts_sorted(const FuncCount* table, FuncCount* out) {
+    int count = 0;
+    for (int i = 0; i < FUNC_TABLE_SIZE; i++) {
+        if (table[i].f != NULL) out[count++] = table[i];
+    }
+    qsort(out, count, sizeof(FuncCount), by_count);
+    return count;
+}
+
+// ============ STATISTICS ============
+#ifdef KSU_STATS
+KsuStats ksu_stats;
+
+// ApplyClosure calls per function; all of them are counted in ksu_stats.applies
+static FuncCount stats_funcs[FUNC_TABLE_SIZE];
+
+void ksu_stats_apply(Lambda_t f) {
+    KSU_STAT(applies);
+    func_count_add(stats_funcs, f);
+}
+
+static const char* lambda_name(Lambda_t f, char* buf, size_t size) {
+    const KsuSourceInfo* info = source_info(f);
+    if (info != NULL) return info->name;
+    snprintf(buf, size, "fn_%lx", (unsigned long)(uintptr_t)f);
+    return buf;
+}
+
+static bool stats_json;
+static bool stats_first = true;
+
+static void stats_print(const char* name, unsigned long value) {
+    if (stats_json) {
+        fprintf(stderr, "%s\"%s\": %lu", stats_first ? "{\n  " : ",\n  ", name, value);
+    } else {
+        fprintf(stderr, "ksu-stats: %s=%lu\n", name, value);
+    }
+    stats_first = false;
+}
+
+// Registered with atexit by ksu_init when KSU_STATS is set
+static void stats_dump(void) {
+    char name[64];
+    stats_json = strcmp(getenv("KSU_STATS"), "json") == 0;
+    for (int t = 0; t < KSU_TAG_COUNT; t++) {
+        // Numbers, booleans and nil are immediates and never allocated
+        if (t == NUMBER || t == BOOLEAN || t == NIL) continue;
+        snprintf(name, sizeof(name), "alloc_%s", type_to_string((ValueTag)t));
+        for (char* c = name; *c; c++) *c = (char)tolower((unsigned char)*c);
+        stats_print(name, ksu_stats.allocs[t]);
+    }
+    stats_print("alloc_bytes", ksu_stats.alloc_bytes);
+    stats_print("envs", ksu_stats.envs);
+    stats_print("env_slots", ksu_stats.env_slots);
+    for (int i = 0; i < KSU_ENV_SIZES; i++) {
+        if (i < KSU_ENV_SIZES - 1) snprintf(name, sizeof(name), "env_size_%d", i);
+        else snprintf(name, sizeof(name), "env_size_%d_or_more", i);
+        stats_print(name, ksu_stats.env_sizes[i]);
+    }
+    stats_print("env_refs", ksu_stats.env_refs);
+    stats_print("bounces", ksu_stats.bounces);
+    stats_print("stack_resets", ksu_stats.stack_resets);
+    stats_print("applies", ksu_stats.applies);
+    stats_print("known_calls", ksu_stats.known_calls);
+    stats_print("deep_copy_nodes", ksu_stats.deep_copy_nodes);
+    stats_print("collections", ksu_stats.collections);
+
+    // Most called functions first
+    FuncCount funcs[FUNC_TABLE_SIZE];
+    int count = func_counts_sorted(stats_funcs, funcs);
+    for (int i = 0; i < count; i++) {
+        char buf[32];
+        snprintf(name, sizeof(name), "apply_%s", lambda_name(funcs[i].f, buf, sizeof(buf)));
+        stats_print(name, funcs[i].count);
+    }
+    if (stats_json) fprintf(stderr, "\n}\n");
+}
+#endif
+
+// ============ PROFILER ============
+#define PROFILE_INTERVAL_US 1000
+
+static FuncCount profile_funcs[FUNC_TABLE_SIZE];
+static unsigned long profile_runtime_samples;
+
+static void profile_sample(int sig) {
+    (void)sig;
+    Lambda_t f = ksu_current_func;
+    if (f == NULL) __atomic_fetch_add(&profile_runtime_samples, 1, __ATOMIC_RELAXED);
+    else func_count_add(profile_funcs, f);
+}
+
+// Writes "description (file:line)" for a sampled function
+static void profile_describe(FILE* out, Lambda_t f) {
+    const KsuSourceInfo* info = source_info(f);
+    if (info == NULL) {
+        fprintf(out, "fn_%lx", (unsigned long)(uintptr_t)f);
+    } else if (info->line == 0) {
+        fprintf(out, "%s (<builtin>)", info->description);
+    } else {
+        fprintf(out, "%s (%s:%d)", info->description,
+                &ksu_source_file != NULL ? ksu_source_file : "?", info->line);
+    }
+}
+
+// Collapsed stacks, one "define;function count" line per function. Every
+// call is a tail call, so the stack is just the function and its define.
+static void profile_collapsed(FILE* out, const FuncCount* samples, int count) {
+    if (profile_runtime_samples > 0) fprintf(out, "<runtime> %lu\n", profile_runtime_samples);
+    for (int i = 0; i < count; i++) {
+        const KsuSourceInfo* info = source_info(samples[i].f);
+        fprintf(out, "%s;", info != NULL ? info->define : "?");
+        profile_describe(out, samples[i].f);
+        fprintf(out, " %lu\n", samples[i].count);
+    }
+}
+
+// Registered with atexit by ksu_init when KSU_PROFILE is set
+static void profile_dump(void) {
+    struct itimerval off = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_PROF, &off, NULL);
+
+    FuncCount samples[FUNC_TABLE_SIZE];
+    int count = func_counts_sorted(profile_funcs, samples);
+    unsigned long total = profile_runtime_samples;
+    for (int i = 0; i < count; i++) total += samples[i].count;
+    double percent = total > 0 ? 100.0 / total : 0;
+
+    fprintf(stderr, "ksu-profile: %lu samples, one every %d us of CPU time\n", total, PROFILE_INTERVAL_US);
+    fprintf(stderr, "%8s %6s  %s\n", "samples", "%", "function");
+    if (profile_runtime_samples > 0) {
+        fprintf(stderr, "%8lu %5.1f%%  <runtime>\n", profile_runtime_samples, profile_runtime_samples * percent);
+    }
+    for (int i = 0; i < count; i++) {
+        fprintf(stderr, "%8lu %5.1f%%  ", samples[i].count, samples[i].count * percent);
+        profile_describe(stderr, samples[i].f);
+        fprintf(stderr, "\n");
+    }
+
+    const char* path = getenv("KSU_PROFILE");
+    if (strcmp(path, "1") == 0) {
+        profile_collapsed(stderr, samples, count);
+        return;
+    }
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "ksu-profile: cannot write %s\n", path);
+        return;
+    }
+    profile_collapsed(out, samples, count);
+    fclose(out);
+}
+
+static void profile_start(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = profile_sample;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    struct itimerval timer = { { 0, PROFILE_INTERVAL_US }, { 0, PROFILE_INTERVAL_US } };
+    setitimer(ITIMER_PROF, &timer, NULL);
+    atexit(profile_dump);
+}
+
+// ============ INITIALIZATION ============
+// Called first thing in the generated main.
+void ksu_init(void) {
+#ifdef KSU_STATS
+    if (getenv("KSU_STATS") != NULL) atexit(stats_dump);
+#endif
+    if (getenv("KSU_PROFILE") != NULL) profile_start();
+    output_interactive = isatty(STDOUT_FILENO);
+    atexit(output_at_exit);
+    nil = MakeNil();
+    id = MakeClosure(__id_impl, NULL);
+    task_exit = MakeClosure(__task_exit_impl, NULL);
+    gc_add_root(&nil);
+    gc_add_root(&id);
+    gc_add_root(&task_exit);
+    gc_add_root(&scheduler_k);
+    gc_add_root_scanner(scan_tasks);
+    gc_add_root_scanner(scan_symbols);
 }
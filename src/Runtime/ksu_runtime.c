@@ -1,79 +1,620 @@
+#define _GNU_SOURCE  // pthread_getattr_np
 #include "ksu_runtime.h"
-#include <stdarg.h>
+
+#include <setjmp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 
 void runtime_error(const char* msg) {
     fprintf(stderr, "Runtime error: %s\n", msg);
+    ksu_report_location();
     exit(1);
 }
 
-ClosureEnv MakeEnv(int count, ...) {
-    if (count == 0) {
+// ============ ALLOCATOR ============
+// Every allocation is preceded by a small header. Small objects (Values,
+// environments, thunk argument vectors) live in fixed-size cells carved out
+// of chunks, one size class per chunk. Each thread allocates by popping its
+// per-class free list or bumping the pointer of its current chunk, so the
+// fast path takes no locks. Anything larger than ALLOC_MAX_SMALL is malloc'ed
+// separately and kept on a list.
+//
+// Building with -DKSU_SYSTEM_MALLOC sends every allocation through malloc
+// instead, which is what run_benchmarks.py --compare-malloc measures against.
+typedef struct GcHeader {
+    unsigned int size;      // cell size in bytes, header included
+    unsigned char kind;     // GcKind, or one of the ALLOC_* kinds below
+    bool marked;
+} GcHeader;
+
+#define ALLOC_FREE 0xff     // cell is on a free list
+#define ALLOC_RAW 0xfe      // runtime-owned memory, released with ksu_free
+
+#define ALLOC_GRANULE 16
+#define ALLOC_NUM_CLASSES 16
+#define ALLOC_MAX_SMALL (ALLOC_GRANULE * ALLOC_NUM_CLASSES)
+#define ALLOC_CHUNK_SIZE (256 * 1024)
+
+#define GC_HEADER(obj) ((GcHeader*)((char*)(obj) - sizeof(GcHeader)))
+#define GC_OBJECT(hdr) ((void*)((char*)(hdr) + sizeof(GcHeader)))
+
+typedef struct FreeCell {
+    GcHeader h;
+    struct FreeCell* next;
+} FreeCell;
+
+struct AllocCursor;
+
+typedef struct Chunk {
+    struct Chunk* next;
+    struct AllocCursor* owner;  // cursors of the thread that allocated the chunk
+    unsigned int cell_size;
+    char* top;              // cells below top have been handed out at least once
+    char* limit;
+    char data[];
+} Chunk;
+
+typedef struct LargeObject {
+    struct LargeObject* next;
+    GcHeader h;
+} LargeObject;
+
+typedef struct AllocCursor {
+    Chunk* chunk;           // chunk currently being bumped
+    FreeCell* free;         // cells recycled by the collector or ksu_free
+} AllocCursor;
+
+static _Thread_local AllocCursor alloc_cursors[ALLOC_NUM_CLASSES];
+struct KsuThread;
+static struct KsuThread* current_thread(void);
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;  // guards the two lists
+static Chunk* alloc_chunks = NULL;
+static LargeObject* alloc_large = NULL;
+
+#ifndef KSU_SYSTEM_MALLOC
+static Chunk* alloc_new_chunk(int size_class) {
+    Chunk* chunk = (Chunk*)malloc(ALLOC_CHUNK_SIZE);
+    if (!chunk) {
+        runtime_error("allocator: out of memory");
+    }
+    current_thread();  // a thread is registered before it owns any chunk
+    chunk->owner = alloc_cursors;
+    chunk->cell_size = (unsigned int)((size_class + 1) * ALLOC_GRANULE);
+    chunk->top = chunk->data;
+    chunk->limit = (char*)chunk + ALLOC_CHUNK_SIZE;
+    pthread_mutex_lock(&alloc_lock);
+    chunk->next = alloc_chunks;
+    alloc_chunks = chunk;
+    pthread_mutex_unlock(&alloc_lock);
+    return chunk;
+}
+#endif
+
+static GcHeader* alloc_cell(size_t size) {
+    size_t total = sizeof(GcHeader) + size;
+#ifndef KSU_SYSTEM_MALLOC
+    if (total <= ALLOC_MAX_SMALL) {
+        int size_class = (int)((total - 1) / ALLOC_GRANULE);
+        AllocCursor* cur = &alloc_cursors[size_class];
+
+        FreeCell* cell = cur->free;
+        if (cell != NULL) {
+            cur->free = cell->next;
+            return &cell->h;
+        }
+
+        Chunk* chunk = cur->chunk;
+        if (chunk == NULL || chunk->top + chunk->cell_size > chunk->limit) {
+            chunk = cur->chunk = alloc_new_chunk(size_class);
+        }
+        GcHeader* hdr = (GcHeader*)chunk->top;
+        chunk->top += chunk->cell_size;
+        hdr->size = chunk->cell_size;
+        return hdr;
+    }
+#endif
+    LargeObject* obj = (LargeObject*)malloc(sizeof(LargeObject) + size);
+    if (!obj) {
+        runtime_error("allocator: out of memory");
+    }
+    pthread_mutex_lock(&alloc_lock);
+    obj->next = alloc_large;
+    alloc_large = obj;
+    pthread_mutex_unlock(&alloc_lock);
+    obj->h.size = (unsigned int)total;
+    return &obj->h;
+}
+
+void* ksu_alloc(size_t size) {
+#ifdef KSU_SYSTEM_MALLOC
+    void* ptr = malloc(size);
+    if (!ptr) {
+        runtime_error("allocator: out of memory");
+    }
+    return ptr;
+#else
+    GcHeader* hdr = alloc_cell(size);
+    hdr->kind = ALLOC_RAW;
+    hdr->marked = false;
+    return GC_OBJECT(hdr);
+#endif
+}
+
+void ksu_free(void* ptr) {
+#ifdef KSU_SYSTEM_MALLOC
+    free(ptr);
+#else
+    GcHeader* hdr = GC_HEADER(ptr);
+    if (hdr->size > ALLOC_MAX_SMALL) {
+        // Large raw blocks stay on the large list; the next sweep releases them.
+        hdr->kind = ALLOC_FREE;
+        return;
+    }
+    FreeCell* cell = (FreeCell*)hdr;
+    AllocCursor* cur = &alloc_cursors[hdr->size / ALLOC_GRANULE - 1];
+    cell->h.kind = ALLOC_FREE;
+    cell->next = cur->free;
+    cur->free = cell;
+#endif
+}
+
+// ============ THREADS ============
+// Chase-Lev work-stealing deque (Le et al., "Correct and Efficient
+// Work-Stealing for Weak Memory Models"). The owner pushes and takes at the
+// bottom, thieves steal from the top; only taking the last element and
+// stealing need a compare-and-swap. Arrays that were outgrown stay allocated,
+// since a thief may still be reading from one.
+typedef struct DequeArray {
+    long size;              // always a power of two
+    struct DequeArray* prev;
+    _Atomic(Value*) slots[];
+} DequeArray;
+
+typedef struct Deque {
+    _Atomic long top;
+    _Atomic long bottom;
+    _Atomic(DequeArray*) array;
+} Deque;
+
+static DequeArray* deque_array_new(long size, DequeArray* prev) {
+    DequeArray* a = (DequeArray*)malloc(sizeof(DequeArray) + sizeof(Value*) * size);
+    if (!a) {
+        runtime_error("deque: out of memory");
+    }
+    a->size = size;
+    a->prev = prev;
+    return a;
+}
+
+static void deque_push(Deque* d, Value* v) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    DequeArray* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    if (b - t > a->size - 1) {
+        DequeArray* grown = deque_array_new(a->size * 2, a);
+        for (long i = t; i < b; i++) {
+            atomic_store_explicit(&grown->slots[i & (grown->size - 1)],
+                                  atomic_load_explicit(&a->slots[i & (a->size - 1)], memory_order_relaxed),
+                                  memory_order_relaxed);
+        }
+        atomic_store_explicit(&d->array, grown, memory_order_release);
+        a = grown;
+    }
+    atomic_store_explicit(&a->slots[b & (a->size - 1)], v, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+static Value* deque_take(Deque* d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    DequeArray* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+    Value* v = atomic_load_explicit(&a->slots[b & (a->size - 1)], memory_order_relaxed);
+    if (t == b) {
+        // Last element: race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            v = NULL;
+        }
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return v;
+}
+
+// NULL if the deque is empty or another thread won the race
+static Value* deque_steal(Deque* d) {
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) return NULL;
+    DequeArray* a = atomic_load_explicit(&d->array, memory_order_acquire);
+    Value* v = atomic_load_explicit(&a->slots[t & (a->size - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
         return NULL;
     }
+    return v;
+}
+
+// Every thread that allocates is registered here, so a collection can find
+// its roots and its allocator cursors.
+typedef struct KsuThread {
+    AllocCursor* cursors;   // the thread's alloc_cursors
+    Thunk* pending;         // pending call while stopped at a safepoint
+    Value* job;             // job a worker is running
+    KsuFrame** frames;      // the thread's ksu_frames
+    Deque deque;
+} KsuThread;
+
+#define KSU_MAX_THREADS 256
+
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;  // guards registration and collections
+static KsuThread* threads[KSU_MAX_THREADS];
+static _Atomic int threads_count = 0;
+static _Thread_local KsuThread* this_thread = NULL;
 
-    EnvEntry* env = (EnvEntry*)malloc(sizeof(EnvEntry) * (count + 1));
-    if (!env) {
-        runtime_error("failed to allocate environment");
+static KsuThread* current_thread(void) {
+    if (this_thread == NULL) {
+        KsuThread* t = (KsuThread*)calloc(1, sizeof(KsuThread));
+        if (!t) {
+            runtime_error("threads: out of memory");
+        }
+        t->cursors = alloc_cursors;
+        t->frames = &ksu_frames;
+        atomic_store(&t->deque.array, deque_array_new(64, NULL));
+        // A collection in progress holds gc_lock, so we cannot join halfway through it
+        pthread_mutex_lock(&gc_lock);
+        int n = atomic_load(&threads_count);
+        if (n == KSU_MAX_THREADS) {
+            runtime_error("threads: too many threads");
+        }
+        threads[n] = t;
+        atomic_store(&threads_count, n + 1);
+        pthread_mutex_unlock(&gc_lock);
+        this_thread = t;
     }
+    return this_thread;
+}
 
-    va_list args;
-    va_start(args, count);
+// ============ GARBAGE COLLECTOR ============
+// Mark-sweep over the allocator's chunks and large objects. Marking uses an
+// explicit stack so long lists do not overflow the C stack. Threads report
+// their allocations to the shared counter in GC_FLUSH_BYTES batches.
+#define GC_MIN_THRESHOLD (32 * 1024 * 1024)
+#define GC_FLUSH_BYTES (64 * 1024)
 
-    for (int i = 0; i < count; i++) {
-        char* name = va_arg(args, char*);
-        Value* val_ptr = va_arg(args, Value*);
-        env[i].name = name;
-        env[i].val = val_ptr;
+_Atomic bool gc_pending = false;
+
+static _Atomic size_t gc_allocated = 0;  // bytes allocated since the last collection
+static size_t gc_threshold = GC_MIN_THRESHOLD;
+static _Thread_local size_t gc_unflushed = 0;
+
+static pthread_cond_t gc_resume = PTHREAD_COND_INITIALIZER;
+static int gc_stopped = 0;           // threads waiting at a safepoint
+static unsigned long gc_epoch = 0;   // collections so far
+
+static Value*** gc_roots = NULL;
+static int gc_roots_count = 0;
+static int gc_roots_capacity = 0;
+
+static GcRootScanner* gc_scanners = NULL;
+static int gc_scanners_count = 0;
+
+static GcHeader** gc_stack = NULL;
+static int gc_stack_count = 0;
+static int gc_stack_capacity = 0;
+
+void* gc_alloc(GcKind kind, size_t size) {
+    GcHeader* hdr = alloc_cell(size);
+    hdr->kind = kind;
+    hdr->marked = false;
+    KSU_STAT_ADD(alloc_bytes, hdr->size);
+    gc_unflushed += hdr->size;
+    if (gc_unflushed >= GC_FLUSH_BYTES) {
+        if (atomic_fetch_add(&gc_allocated, gc_unflushed) + gc_unflushed >= gc_threshold) {
+            gc_pending = true;
+        }
+        gc_unflushed = 0;
     }
+    return GC_OBJECT(hdr);
+}
 
-    env[count].name = NULL;
+void gc_add_root(Value** root) {
+    if (gc_roots_count == gc_roots_capacity) {
+        gc_roots_capacity = gc_roots_capacity ? gc_roots_capacity * 2 : 64;
+        gc_roots = (Value***)realloc(gc_roots, sizeof(Value**) * gc_roots_capacity);
+        if (!gc_roots) {
+            runtime_error("gc_add_root: out of memory");
+        }
+    }
+    gc_roots[gc_roots_count++] = root;
+}
 
-    va_end(args);
-    return env;
+static void gc_push(void* obj) {
+    if (obj == NULL || IS_IMMEDIATE(obj)) return;
+    GcHeader* hdr = GC_HEADER(obj);
+    if (hdr->marked) return;
+    hdr->marked = true;
+    if (gc_stack_count == gc_stack_capacity) {
+        gc_stack_capacity = gc_stack_capacity ? gc_stack_capacity * 2 : 1024;
+        gc_stack = (GcHeader**)realloc(gc_stack, sizeof(GcHeader*) * gc_stack_capacity);
+        if (!gc_stack) {
+            runtime_error("gc: out of memory for mark stack");
+        }
+    }
+    gc_stack[gc_stack_count++] = hdr;
+}
+
+void gc_add_root_scanner(GcRootScanner scan) {
+    gc_scanners = (GcRootScanner*)realloc(gc_scanners, sizeof(GcRootScanner) * (gc_scanners_count + 1));
+    if (!gc_scanners) {
+        runtime_error("gc_add_root_scanner: out of memory");
+    }
+    gc_scanners[gc_scanners_count++] = scan;
+}
+
+void gc_mark(Value* v) {
+    gc_push(v);
+}
+
+static void gc_trace(GcHeader* hdr) {
+    if (hdr->kind == GC_ENV) {
+        Env* env = (Env*)GC_OBJECT(hdr);
+        for (int i = 0; i < env->size; i++) {
+            gc_push(env->slots[i]);
+        }
+        return;
+    }
+
+    Value* v = (Value*)GC_OBJECT(hdr);
+    switch (v->t) {
+        case PAIR:
+            gc_push(v->pair.first);
+            gc_push(v->pair.second);
+            break;
+        case CLOSURE:
+            gc_push(v->closure.env);
+            break;
+        case BOX:
+            gc_push(v->box.ptr);
+            break;
+        case FUTURE:
+            gc_push(v->future.thunk);
+            gc_push(v->future.value);
+            break;
+        case VECTOR:
+            for (int i = 0; i < v->vector.length; i++) {
+                gc_push(v->vector.items[i]);
+            }
+            break;
+        case HASHTABLE:
+            gc_push(v->hashtable.entries);
+            break;
+        default:
+            break;
+    }
 }
 
-Value* EnvRef(ClosureEnv env, const char* id) {
-    if (!env) {
-        fprintf(stderr, "EnvRef: NULL environment for variable '%s'\n", id);
-        runtime_error("unbound variable");
+// Returns the bytes that survived. Chunks without survivors go back to malloc;
+// dead cells of the others are threaded onto the free lists of the thread
+// that owns the chunk.
+static size_t gc_sweep(void) {
+    size_t live = 0;
+
+    int count = atomic_load(&threads_count);
+    for (int t = 0; t < count; t++) {
+        for (int i = 0; i < ALLOC_NUM_CLASSES; i++) {
+            threads[t]->cursors[i].free = NULL;
+        }
     }
 
-    for (int i = 0; env[i].name != NULL; i++) {
-        if (strcmp(env[i].name, id) == 0) {
-            if (env[i].val == NULL) {
-                fprintf(stderr, "EnvRef: variable '%s' has NULL value\n", id);
-                runtime_error("variable has NULL value");
+    Chunk** chunk_link = &alloc_chunks;
+    while (*chunk_link != NULL) {
+        Chunk* chunk = *chunk_link;
+        AllocCursor* cur = &chunk->owner[chunk->cell_size / ALLOC_GRANULE - 1];
+        FreeCell* free_cells = cur->free;
+        size_t chunk_live = 0;
+
+        for (char* p = chunk->data; p < chunk->top; p += chunk->cell_size) {
+            GcHeader* hdr = (GcHeader*)p;
+            if (hdr->marked || hdr->kind == ALLOC_RAW) {
+                hdr->marked = false;
+                chunk_live += chunk->cell_size;
+            } else {
+                FreeCell* cell = (FreeCell*)hdr;
+                cell->h.kind = ALLOC_FREE;
+                cell->next = free_cells;
+                free_cells = cell;
             }
-            return env[i].val;
         }
+
+        if (chunk_live == 0 && chunk != cur->chunk) {
+            *chunk_link = chunk->next;
+            free(chunk);
+            continue;
+        }
+        cur->free = free_cells;
+        live += chunk_live;
+        chunk_link = &chunk->next;
     }
 
-    fprintf(stderr, "EnvRef: unbound variable '%s'\n", id);
-    runtime_error("unbound variable");
-    return NULL; // unreachable
+    LargeObject** large_link = &alloc_large;
+    while (*large_link != NULL) {
+        LargeObject* obj = *large_link;
+        if (obj->h.marked || obj->h.kind == ALLOC_RAW) {
+            obj->h.marked = false;
+            live += obj->h.size;
+            large_link = &obj->next;
+        } else {
+            *large_link = obj->next;
+            free(obj);
+        }
+    }
+    return live;
+}
+
+static void gc_mark_thunk(Thunk* t) {
+    gc_push(t->env);
+    gc_push(t->result);
+    Value** argv = thunk_args(t);
+    for (int i = 0; i < t->argc; i++) {
+        gc_push(argv[i]);
+    }
 }
 
-bool is_true(Value* v) {
-    if (v == NULL) {
-        fprintf(stderr, "is_true: NULL value\n");
-        runtime_error("is_true called with NULL");
+static void gc_mark_thread(KsuThread* thread) {
+    if (thread->pending != NULL) {
+        gc_mark_thunk(thread->pending);
     }
-    if (v->t == BOOLEAN) {
-        return v->boolean.value;
+    gc_push(thread->job);
+    for (KsuFrame* f = *thread->frames; f != NULL; f = f->prev) {
+        for (int i = 0; i < f->size; i++) {
+            gc_push(*f->roots[i]);
+        }
+    }
+    Deque* d = &thread->deque;
+    DequeArray* a = atomic_load(&d->array);
+    for (long i = atomic_load(&d->top); i < atomic_load(&d->bottom); i++) {
+        gc_push(atomic_load(&a->slots[i & (a->size - 1)]));
+    }
+}
+
+// Runs with every other thread stopped at a safepoint
+static void gc_run(void) {
+    KSU_STAT(collections);
+    // Mark
+    int count = atomic_load(&threads_count);
+    for (int i = 0; i < count; i++) {
+        gc_mark_thread(threads[i]);
+    }
+    for (int i = 0; i < gc_roots_count; i++) {
+        gc_push(*gc_roots[i]);
+    }
+    for (int i = 0; i < gc_scanners_count; i++) {
+        gc_scanners[i]();
+    }
+    while (gc_stack_count > 0) {
+        gc_trace(gc_stack[--gc_stack_count]);
+    }
+
+    size_t live = gc_sweep();
+
+    // Next collection once we have allocated twice what survived.
+    gc_allocated = 0;
+    gc_threshold = 2 * live > GC_MIN_THRESHOLD ? 2 * live : GC_MIN_THRESHOLD;
+}
+
+void gc_collect(Thunk* t) {
+    KsuThread* me = current_thread();
+    pthread_mutex_lock(&gc_lock);
+    // Another thread may have collected since we saw gc_pending
+    if (gc_pending) {
+        me->pending = t;
+        if (++gc_stopped < atomic_load(&threads_count)) {
+            unsigned long epoch = gc_epoch;
+            while (epoch == gc_epoch) {
+                pthread_cond_wait(&gc_resume, &gc_lock);
+            }
+        } else {
+            gc_run();
+            gc_stopped = 0;
+            gc_epoch++;
+            gc_pending = false;
+            pthread_cond_broadcast(&gc_resume);
+        }
+        me->pending = NULL;
     }
-    return true;  // Non-false values are truthy
+    pthread_mutex_unlock(&gc_lock);
+}
+
+ClosureEnv MakeEnv(int size, const char* const* names, Value** vals) {
+    Env* env = (Env*)gc_alloc(GC_ENV, sizeof(Env) + sizeof(Value*) * size);
+    env->size = size;
+    env->names = names;
+    memcpy(env->slots, vals, sizeof(Value*) * size);
+    KSU_STAT(envs);
+    KSU_STAT_ADD(env_slots, size);
+    KSU_STAT(env_sizes[size < KSU_ENV_SIZES - 1 ? size : KSU_ENV_SIZES - 1]);
+    return env;
+}
+
+_Thread_local int ksu_call_depth = 0;
+_Thread_local char* ksu_stack_base = NULL;
+_Thread_local Lambda_t ksu_current_func = NULL;
+
+// State of the innermost Trampoline. It lives outside the driver's frame,
+// because ksu_stack_reset longjmps back into the middle of it.
+static _Thread_local jmp_buf reset_point;
+static _Thread_local Thunk pending;
+static _Thread_local Value** pending_argv;  // heap argv of the running call
+
+void ksu_stack_reset(Lambda_t f, ClosureEnv env, int argc, Value** argv) {
+    KSU_STAT(stack_resets);
+    pending = MakeThunk(f, env, argc, argv);
+    longjmp(reset_point, 1);
 }
 
 Value* Trampoline(Thunk t) {
-    while (t.func != NULL) {
-        Value** argv = t.argv;
-        t = t.func(t.env, t.argc, argv);
-        // Free argv after calling (allocated by MakeThunk)
-        if (argv != NULL) {
-            free(argv);
+    // Trampolines may nest, so save the outer driver's state
+    jmp_buf outer_reset_point;
+    memcpy(outer_reset_point, reset_point, sizeof(jmp_buf));
+    char* outer_stack_base = ksu_stack_base;
+    Thunk outer_pending = pending;
+    Value** outer_pending_argv = pending_argv;
+    Lambda_t outer_func = ksu_current_func;
+
+    char base;
+    pending = t;
+    pending_argv = NULL;
+    // A stack reset lands here with the call to continue in pending
+    setjmp(reset_point);
+    ksu_stack_base = &base;
+    if (pending_argv != NULL) {
+        ksu_free(pending_argv);
+        pending_argv = NULL;
+    }
+
+    while (pending.func != NULL) {
+        // Safepoint: between bounces the pending thunk is the only live
+        // state besides the global roots.
+        if (gc_pending) {
+            ksu_current_func = NULL;
+            gc_collect(&pending);
+        }
+        ksu_call_depth = 0;
+        KSU_STAT(bounces);
+        Thunk cur = pending;
+        ksu_current_func = cur.func;
+        if (cur.argc <= THUNK_INLINE_ARGS) {
+            // The callee's thunk overwrites pending, so hand it a copy of the arguments
+            Value* args[THUNK_INLINE_ARGS];
+            memcpy(args, cur.args, sizeof(Value*) * cur.argc);
+            pending = cur.func(cur.env, cur.argc, args);
+        } else {
+            // Free argv after calling (allocated by MakeThunk)
+            pending_argv = cur.argv;
+            pending = cur.func(cur.env, cur.argc, cur.argv);
+            ksu_free(pending_argv);
+            pending_argv = NULL;
         }
     }
-    return t.result;
+
+    Value* result = pending.result;
+    memcpy(reset_point, outer_reset_point, sizeof(jmp_buf));
+    ksu_stack_base = outer_stack_base;
+    pending = outer_pending;
+    pending_argv = outer_pending_argv;
+    ksu_current_func = outer_func;
+    return result;
 }
 
 Thunk DoneThunk(Value* v) {
@@ -91,20 +632,182 @@ Thunk MakeThunk(Lambda_t func, ClosureEnv env, int argc, Value** argv) {
     t.func = func;
     t.env = env;
     t.argc = argc;
-    // Copy argv to heap to avoid stack issues
-    if (argc > 0 && argv != NULL) {
-        Value** argv_copy = (Value**)malloc(sizeof(Value*) * argc);
-        if (!argv_copy) {
-            runtime_error("MakeThunk: malloc failed for argv");
-        }
+    // Copy argv out of the caller's frame: inline for small arities,
+    // to the heap for the rest
+    if (argc <= THUNK_INLINE_ARGS) {
         for (int i = 0; i < argc; i++) {
-            argv_copy[i] = argv[i];
+            t.args[i] = argv[i];
         }
-        t.argv = argv_copy;
-    } else {
         t.argv = NULL;
+    } else {
+        Value** argv_copy = (Value**)ksu_alloc(sizeof(Value*) * argc);
+        memcpy(argv_copy, argv, sizeof(Value*) * argc);
+        t.argv = argv_copy;
     }
     t.result = NULL;
     return t;
 }
 
+// ============ DIRECT STYLE ============
+_Thread_local KsuFrame* ksu_frames = NULL;
+_Thread_local char* ksu_stack_limit = NULL;
+
+// Room left below ksu_stack_limit for runtime_error and whatever the last
+// direct-style frames need
+#define KSU_STACK_MARGIN (1 << 20)
+
+void ksu_safepoint(void) {
+    char here;
+    if ((uintptr_t)&here < (uintptr_t)ksu_stack_limit) {
+        runtime_error("stack overflow: recursion is too deep");
+    }
+    if (gc_pending) {
+        Lambda_t func = ksu_current_func;
+        ksu_current_func = NULL;
+        gc_collect(NULL);
+        ksu_current_func = func;
+    }
+}
+
+// Called first thing on every thread that runs ksu code
+static void set_stack_limit(void) {
+    pthread_attr_t attr;
+    void* low;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) return;
+    if (pthread_attr_getstack(&attr, &low, &size) == 0 && size > 2 * KSU_STACK_MARGIN) {
+        ksu_stack_limit = (char*)low + KSU_STACK_MARGIN;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Starts a thread with a KSU_STACK_SIZE stack, or the default one if that
+// much address space cannot be had
+static int start_thread(pthread_t* thread, void* (*run)(void*), void* arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, KSU_STACK_SIZE);
+    int err = pthread_create(thread, &attr, run, arg);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        err = pthread_create(thread, NULL, run, arg);
+    }
+    return err;
+}
+
+// ============ WORKERS ============
+static void (*worker_run)(Value* job) = NULL;
+static int workers_count = 0;
+static _Thread_local bool on_worker = false;
+
+bool ksu_on_worker(void) {
+    return on_worker;
+}
+
+void ksu_push_job(Value* job) {
+    if (workers_count == 0) return;
+    deque_push(&current_thread()->deque, job);
+}
+
+// Tries every other thread's deque once, starting at a random one
+static Value* steal_job(KsuThread* me, unsigned int* seed) {
+    int count = atomic_load(&threads_count);
+    *seed = *seed * 1103515245 + 12345;
+    int start = (int)((*seed >> 16) % (unsigned int)count);
+    for (int i = 0; i < count; i++) {
+        KsuThread* victim = threads[(start + i) % count];
+        if (victim == me) continue;
+        Value* job = deque_steal(&victim->deque);
+        if (job != NULL) return job;
+    }
+    return NULL;
+}
+
+static void worker_idle(int rounds) {
+    if (rounds < 64) {
+        sched_yield();
+        return;
+    }
+    struct timespec pause = { 0, 50 * 1000 };
+    nanosleep(&pause, NULL);
+}
+
+static void* worker_main(void* arg) {
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    set_stack_limit();
+    on_worker = true;
+    KsuThread* me = current_thread();
+    int idle = 0;
+    for (;;) {
+        // An idle worker has nothing live, but the others still wait for it
+        if (gc_pending) {
+            gc_collect(NULL);
+        }
+        Value* job = deque_take(&me->deque);
+        if (job == NULL) {
+            job = steal_job(me, &seed);
+        }
+        if (job == NULL) {
+            worker_idle(idle++);
+            continue;
+        }
+        idle = 0;
+        me->job = job;
+        worker_run(job);
+        me->job = NULL;
+    }
+    return NULL;
+}
+
+void ksu_start_workers(void (*run)(Value* job)) {
+    static bool started = false;
+    if (started) return;
+    started = true;
+
+    long n;
+    const char* env = getenv("KSU_WORKERS");
+    if (env != NULL) {
+        n = strtol(env, NULL, 10);
+    } else {
+        n = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    }
+    if (n <= 0) return;
+    if (n > KSU_MAX_THREADS - 1) n = KSU_MAX_THREADS - 1;
+
+    current_thread();
+    worker_run = run;
+    workers_count = (int)n;
+    for (long i = 0; i < n; i++) {
+        pthread_t thread;
+        if (start_thread(&thread, worker_main, (void*)(uintptr_t)(i + 1)) != 0) {
+            runtime_error("workers: cannot start thread");
+        }
+        pthread_detach(thread);
+    }
+}
+
+// ============ MAIN ============
+static void (*program_main)(void);
+
+static void* run_program(void* arg) {
+    (void)arg;
+    set_stack_limit();
+    ksu_init();
+    program_main();
+    return NULL;
+}
+
+int ksu_main(void (*program)(void)) {
+    program_main = program;
+    pthread_t thread;
+    if (start_thread(&thread, run_program, NULL) != 0) {
+        runtime_error("main: cannot start thread");
+    }
+    // Profiler samples belong to the program, not to this thread waiting for it
+    sigset_t prof;
+    sigemptyset(&prof);
+    sigaddset(&prof, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &prof, NULL);
+    pthread_join(thread, NULL);
+    return 0;
+}
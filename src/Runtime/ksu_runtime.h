@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 // Forward declarations
 union Value;
@@ -12,7 +14,7 @@ typedef union Value Value;
 struct ListItem;
 struct Thunk;
 typedef struct Thunk Thunk;
-struct EnvEntry;
+struct Env;
 
 // ============ VALUE TAGS ============
 typedef enum ValueTag {
@@ -24,26 +26,36 @@ typedef enum ValueTag {
     NIL,
     BOX,
     SYMBOL,
+    FUTURE,
+    VECTOR,
+    HASHTABLE,
 } ValueTag;
 
 // ============ PRIMITIVE VALUES ============
-struct ValueInt {
-    ValueTag t;
-    int value;
-};
+// Numbers, booleans and nil are immediates: they live in the Value* word
+// itself and are never allocated. Heap objects are at least 8-byte aligned,
+// so the low bits tell them apart:
+//   ...xxx1  fixnum, the int value is stored in the upper bits
+//   ...0010  #f,  ...0110  #t,  ...1010  nil
+//   ...x000  pointer to a heap Value (NULL is never a valid value)
+#define KSU_FIXNUM_BIT ((intptr_t)1)
+#define KSU_FALSE ((Value*)(intptr_t)0x2)
+#define KSU_TRUE ((Value*)(intptr_t)0x6)
+#define KSU_NIL ((Value*)(intptr_t)0xa)
+
+#define IS_FIXNUM(v) (((intptr_t)(v) & KSU_FIXNUM_BIT) != 0)
+#define BOTH_FIXNUM(a, b) (((intptr_t)(a) & (intptr_t)(b) & KSU_FIXNUM_BIT) != 0)
+#define IS_IMMEDIATE(v) (((intptr_t)(v) & 0x7) != 0)
+#define INT_VALUE(v) ((int)((intptr_t)(v) >> 1))
+#define BOOL_VALUE(v) ((v) == KSU_TRUE)
 
 struct ValueString {
     ValueTag t;
     char* value;
 };
 
-struct ValueBool {
-    ValueTag t;
-    bool value;
-};
-
 // ============ CLOSURES ============
-typedef struct EnvEntry* ClosureEnv;
+typedef struct Env* ClosureEnv;
 typedef Thunk (*Lambda_t)(ClosureEnv, int, Value**);
 
 struct ValueClosure {
@@ -59,63 +71,239 @@ struct ValueClosure {
 // MakeInt(1) <- ValuePair -> (MakeInt(2) <- ValuePair -> (MakeInt(3) <- ValuePair -> MakeNil())
 struct ValuePair {
     ValueTag t;
+    bool has_box;  // a box is reachable through first/second
     Value* first;  
     Value* second;
 };
 
-struct ValueNil {
-    ValueTag t;
-};
-
 // ============ BOXES ============
+// Boxes are the only mutable values. Pairs, strings and symbols never change,
+// so a box simply points at its contents and set!/unwrap are O(1): sharing is
+// indistinguishable from the copy that is made with -DKSU_BOX_COPY.
+// A box may not hold another box, not even nested inside pairs; the has_box
+// bit of pairs lets box and set! check that without walking the value.
 struct ValueBox {
     ValueTag t;
     Value* ptr;
 };
 
 // ============ SYMBOLS ============
+// Symbols are interned: MakeSymbol returns the one symbol with a given name,
+// so symbols are compared by pointer and shared instead of copied. Interned
+// symbols live as long as the program. The hash of the name is kept for
+// hash tables.
 struct ValueSymbol {
     ValueTag t;
+    int hash;
     char* name;
 };
 
+// ============ FUTURES ============
+// A future keeps its thunk until it has run, then its value. The state goes
+// from pending to running to done (see ksu_builtins.c); value may only be
+// read once the done state has been observed.
+struct ValueFuture {
+    ValueTag t;
+    _Atomic int state;
+    Value* thunk;
+    Value* value;
+};
+
+// ============ VECTORS ============
+// A vector is a single allocation: this header followed by its elements,
+// which items points at. Like boxes, vectors are mutable and shared by
+// reference; indexing never allocates.
+struct ValueVector {
+    ValueTag t;
+    int length;
+    Value** items;
+};
+
+// ============ HASH TABLES ============
+// Open addressing with linear probing. The entries live in a vector of
+// 3 * capacity slots, each entry being the key's hash (as a fixnum), the key
+// and the value side by side, so a probe touches one cache line and only
+// compares keys whose hashes match. A NULL key marks a free entry; deletion
+// shifts the following entries back, so there are no tombstones. Keys are
+// numbers, booleans, strings and symbols, compared like =.
+struct ValueHashtable {
+    ValueTag t;
+    int count;
+    Value* entries;  // VECTOR, capacity is a power of two
+};
+
 // ============ VALUE UNION ============
+// Only heap values go through the union; use value_tag() to get the tag of
+// an arbitrary Value*.
 union Value {
     ValueTag t;
-    struct ValueInt integer;
     struct ValueString string;
-    struct ValueBool boolean;
     struct ValuePair pair;
-    struct ValueNil nil;
     struct ValueClosure closure;
     struct ValueBox box;
     struct ValueSymbol symbol;
+    struct ValueFuture future;
+    struct ValueVector vector;
+    struct ValueHashtable hashtable;
 };
 
 // ============ NOW DEFINE COMPLETE STRUCTS ============
-struct EnvEntry {
-    char* name;
-    Value* val;
+// Flat closure environment. The compiler assigns every captured variable a
+// fixed slot and reads it with EnvRef($env, i); names are only kept for debugging.
+struct Env {
+    int size;
+    const char* const* names;
+    Value* slots[];
 };
-typedef struct EnvEntry EnvEntry;
+typedef struct Env Env;
+
+// ============ ALLOCATOR ============
+// Size-class chunk allocator behind every runtime allocation. ksu_alloc is for
+// runtime-owned memory that is released explicitly (thunk argument vectors).
+void* ksu_alloc(size_t size);
+void ksu_free(void* ptr);
+
+// ============ GARBAGE COLLECTOR ============
+// Precise mark-sweep collector. Every Value and every environment array is
+// allocated through gc_alloc, on top of the allocator above. Collection only happens at the trampoline
+// safepoint, where the live set is exactly the pending thunk plus the
+// registered global roots (top-level defines, nil and id), and at the entry of
+// direct-style functions, which register their variables (see DIRECT STYLE).
+// With worker threads the collection stops the world: see WORKERS below.
+typedef enum GcKind {
+    GC_VALUE,
+    GC_ENV,
+} GcKind;
+
+void* gc_alloc(GcKind kind, size_t size);
+void gc_add_root(Value** root);
+extern _Atomic bool gc_pending;
+
+// Runtime structures that keep values elsewhere (e.g. the task queue) register
+// a scanner, which reports each of them with gc_mark when a collection runs.
+typedef void (*GcRootScanner)(void);
+void gc_add_root_scanner(GcRootScanner scan);
+void gc_mark(Value* v);
+
+// ============ IMMEDIATES ============
+// Primitive fast paths are inlined into generated code even without -O.
+#define KSU_INLINE static inline __attribute__((always_inline))
+
+static inline Value* MakeInt(int x) {
+    return (Value*)(((intptr_t)x << 1) | KSU_FIXNUM_BIT);
+}
+
+static inline Value* MakeBool(bool x) {
+    return x ? KSU_TRUE : KSU_FALSE;
+}
+
+static inline Value* MakeNil(void) {
+    return KSU_NIL;
+}
+
+static inline ValueTag value_tag(Value* v) {
+    if (IS_FIXNUM(v)) return NUMBER;
+    if (v == KSU_TRUE || v == KSU_FALSE) return BOOLEAN;
+    if (v == KSU_NIL) return NIL;
+    return v->t;
+}
 
 // ============ RUNTIME FUNCTIONS ============
-void runtime_error(const char* msg);
-ClosureEnv MakeEnv(int count, ...);
-Value* EnvRef(ClosureEnv env, const char* id);
-bool is_true(Value* v);
+void runtime_error(const char* msg) __attribute__((noreturn));
+ClosureEnv MakeEnv(int size, const char* const* names, Value** vals);
+
+KSU_INLINE bool is_true(Value* v) {
+    if (v == NULL) runtime_error("is_true called with NULL");
+    return v != KSU_FALSE;  // Non-false values are truthy
+}
+
+// ============ STATISTICS ============
+// Built with -DKSU_STATS (or ksu build --stats) the runtime counts what the
+// program does, and dumps the counters to stderr at exit when the KSU_STATS
+// environment variable is set: `ksu-stats: name=value` lines, or a JSON object
+// with KSU_STATS=json. Without the define every KSU_STAT compiles to nothing.
+// The runtime must be built with the same setting as the program, so stats
+// builds compile it from source instead of linking libksu.a.
+#define KSU_TAG_COUNT (HASHTABLE + 1)
+#define KSU_ENV_SIZES 9  // environments of 0..7 slots, and 8 or more
+
+typedef struct KsuStats {
+    unsigned long allocs[KSU_TAG_COUNT];  // heap values by tag
+    unsigned long alloc_bytes;            // everything gc_alloc handed out
+    unsigned long envs;
+    unsigned long env_slots;
+    unsigned long env_sizes[KSU_ENV_SIZES];
+    unsigned long env_refs;
+    unsigned long bounces;                // Trampoline iterations
+    unsigned long stack_resets;           // Cheney longjmps
+    unsigned long applies;                // ApplyClosure calls
+    unsigned long known_calls;
+    unsigned long deep_copy_nodes;
+    unsigned long collections;
+} KsuStats;
+
+#ifdef KSU_STATS
+extern KsuStats ksu_stats;
+void ksu_stats_apply(Lambda_t f);
+#define KSU_STAT_ADD(counter, n) __atomic_fetch_add(&ksu_stats.counter, (n), __ATOMIC_RELAXED)
+#else
+#define KSU_STAT_ADD(counter, n) ((void)0)
+#endif
+#define KSU_STAT(counter) KSU_STAT_ADD(counter, 1)
+
+// Reads a captured variable. Slots are fixed at compile time, so every
+// lookup is a single load; env_refs counts them.
+#define EnvRef(env, slot) (KSU_STAT(env_refs), (env)->slots[slot])
+
+// ============ SOURCE MAP ============
+// Generated programs describe each of their functions: its C name, the define
+// it belongs to and the line of ksu_source_file it comes from. The profiler
+// and the per-function ApplyClosure counts report functions through it, and
+// runtime_error names the function it was raised in.
+typedef struct KsuSourceInfo {
+    Lambda_t f;
+    const char* name;         // Lambda_N
+    const char* define;       // enclosing define, or "<toplevel>"
+    const char* description;  // e.g. "continuation of fib at line 5"
+    int line;                 // 0 for builtins
+} KsuSourceInfo;
+
+// Writes "  at <description> (file:line)" for ksu_current_func to stderr, if it
+// comes from the program. A direct-style function that keeps no frame does not
+// record itself, so its errors are reported in its caller.
+void ksu_report_location(void);
+
+// ============ PROFILER ============
+// With KSU_PROFILE set, a SIGPROF timer samples the function each thread is
+// running and a flat profile is printed to stderr at exit. Collapsed stacks
+// for flame graphs go to the file named by KSU_PROFILE (or to stderr too when
+// it is 1). After CPS every call is a tail call, so the function entered last
+// is the one running: Trampoline and the direct calls record it here. NULL
+// means the runtime itself (collections, scheduling).
+extern _Thread_local Lambda_t ksu_current_func;
 
 // ============ TRAMPOLINE ============
 
+// Almost every CPS call passes 1-3 arguments (the last one being the
+// continuation), so those travel inside the thunk itself. Only calls with
+// more than THUNK_INLINE_ARGS arguments copy them to a heap vector.
+#define THUNK_INLINE_ARGS 4
+
 struct Thunk {
     Lambda_t func;      // NULL means computed
     ClosureEnv env;     // closure environment
     int argc;           // argument count
-    Value** argv;       // arguments for the call
+    Value* args[THUNK_INLINE_ARGS]; // arguments when argc <= THUNK_INLINE_ARGS
+    Value** argv;       // heap copy of the arguments otherwise
     Value* result;      // final result (only valid when func == NULL)
 };
 
+static inline Value** thunk_args(Thunk* t) {
+    return t->argc <= THUNK_INLINE_ARGS ? t->args : t->argv;
+}
+
 Value* Trampoline(Thunk t);
+void gc_collect(Thunk* t);
 Thunk DoneThunk(Value* v);
 Thunk MakeThunk(
         Lambda_t f, 
@@ -124,4 +312,404 @@ Thunk MakeThunk(
         Value** argv
     );
 
-#endif // KSU_RUNTIME_H
\ No newline at end of file
+// ============ WORKERS ============
+// Futures run on a pool of worker threads, each with its own trampoline,
+// allocator cursors and Chase-Lev deque of jobs. A thread pushes the jobs it
+// creates onto its own deque; idle workers take from theirs and steal from
+// the others. gc_collect stops the world: every thread waits at its
+// safepoint until the last one arrives, which collects for all of them.
+//
+// The pool is started by the first ksu_start_workers call, with one worker
+// per additional CPU unless KSU_WORKERS says otherwise. Without workers,
+// ksu_push_job drops the job and futures run when they are touched.
+void ksu_start_workers(void (*run)(Value* job));
+void ksu_push_job(Value* job);
+bool ksu_on_worker(void);
+
+// ============ DIRECT CALLS ============
+// By default a closure call returns a thunk to the trampoline. Calls of known
+// top-level functions are plain C calls, which nest on the C stack: the
+// trampoline resets the depth on every bounce, and once it reaches
+// KSU_MAX_CALL_DEPTH the call is handed back to the trampoline instead.
+//
+// With -DKSU_CHENEY (or ksu --cheney) every call is a direct C call, as in
+// Cheney on the M.T.A. Once the stack below Trampoline grows past
+// KSU_STACK_LIMIT, or a collection is due, the pending call is saved as a
+// thunk and the whole stack is dropped with a longjmp back to Trampoline.
+// Values already live in the heap and after CPS the pending call is the only
+// work left, so nothing else has to be evacuated.
+#define KSU_MAX_CALL_DEPTH 64
+extern _Thread_local int ksu_call_depth;
+extern _Thread_local char* ksu_stack_base;  // NULL outside of Trampoline
+void ksu_stack_reset(Lambda_t f, ClosureEnv env, int argc, Value** argv) __attribute__((noreturn));
+
+#ifdef KSU_CHENEY
+#ifndef KSU_STACK_LIMIT
+#define KSU_STACK_LIMIT (1 << 20)
+#endif
+
+KSU_INLINE Thunk CallDirect(Lambda_t f, ClosureEnv env, int argc, Value** argv) {
+    char here;
+    if (ksu_stack_base == NULL) return MakeThunk(f, env, argc, argv);
+    if (gc_pending || (uintptr_t)ksu_stack_base - (uintptr_t)&here > KSU_STACK_LIMIT) {
+        ksu_stack_reset(f, env, argc, argv);
+    }
+    ksu_current_func = f;
+    return f(env, argc, argv);
+}
+
+KSU_INLINE Thunk CallKnown(Lambda_t f, int argc, Value** argv) {
+    KSU_STAT(known_calls);
+    return CallDirect(f, NULL, argc, argv);
+}
+#else
+KSU_INLINE Thunk CallKnown(Lambda_t f, int argc, Value** argv) {
+    KSU_STAT(known_calls);
+    if (ksu_call_depth++ < KSU_MAX_CALL_DEPTH) {
+        ksu_current_func = f;
+        return f(NULL, argc, argv);
+    }
+    return MakeThunk(f, NULL, argc, argv);
+}
+#endif
+
+// ============ BUILTINS ============
+// Implemented in ksu_builtins.c, which is prebuilt into libksu.a together with
+// ksu_runtime.c. This header is all that generated code includes.
+Value* MakeString(const char* x);
+Value* MakePair(Value* l, Value* r);
+Value* MakeClosure(Lambda_t f, ClosureEnv e);
+Value* MakeBox(Value* v);
+Value* MakeSymbol(const char* name);
+Value* MakeFuture(Value* thunk);
+Value* MakeVector(int length, Value* fill);
+Value* MakeHashtable(int capacity);
+Value* MakeStringCopy(const char* x, size_t length);
+Value* deep_copy(Value* v);
+
+extern Value* id;
+extern Value* nil;
+void ksu_init(void);
+
+void apply_error(Value* f) __attribute__((noreturn));
+
+KSU_INLINE Thunk ApplyClosure(Value* f, int argc, Value** argv) {
+    if (f == NULL || IS_IMMEDIATE(f) || f->t != CLOSURE || f->closure.lam == NULL) apply_error(f);
+#ifdef KSU_STATS
+    ksu_stats_apply(f->closure.lam);
+#endif
+#ifdef KSU_CHENEY
+    return CallDirect(f->closure.lam, f->closure.env, argc, argv);
+#else
+    return MakeThunk(f->closure.lam, f->closure.env, argc, argv);
+#endif
+}
+
+// Out-of-line slow paths of the primitives below
+void type_error(Value* v, const char* msg) __attribute__((noreturn));
+void type_error2(Value* a, Value* b, const char* msg) __attribute__((noreturn));
+void division_by_zero(Value* a) __attribute__((noreturn));
+void index_error(Value* v, Value* i) __attribute__((noreturn));
+Value* eq_slow(Value* a, Value* b);
+Value* ne_slow(Value* a, Value* b);
+
+Value* __prim_is_list(Value* v);
+Value* __prim_print(Value* a);
+Value* __prim_string_to_symbol(Value* v);
+Value* __prim_future(Value* thunk);
+Value* __prim_make_vector(Value* n, Value* fill);
+Value* __prim_vector_to_list(Value* v);
+Value* __prim_list_to_vector(Value* l);
+Value* __prim_make_hashtable(void);
+Value* __prim_hashtable_ref(Value* table, Value* key, Value* otherwise);
+Value* __prim_hashtable_set(Value* table, Value* key, Value* value);
+Value* __prim_hashtable_delete(Value* table, Value* key);
+Value* __prim_hashtable_contains(Value* table, Value* key);
+Value* __prim_hashtable_keys(Value* table);
+Value* __prim_hashtable_to_list(Value* table);
+Value* __prim_read_line(void);
+Value* __prim_read_number(void);
+Value* __prim_read_all(void);
+
+// Builtins that need the continuation itself are called in CPS
+Thunk __builtin_raise(Value* v, Value* k);
+Thunk __builtin_spawn(Value* thunk, Value* k);
+Thunk __builtin_yield(Value* k);
+Thunk __builtin_run_scheduler(Value* k);
+Thunk __builtin_touch(Value* f, Value* k);
+
+// Those that do not capture it have a direct-style version too
+Value* __prim_raise(Value* v) __attribute__((noreturn));
+Value* __prim_spawn(Value* thunk);
+Value* __prim_touch(Value* f);
+
+// ============ DIRECT STYLE ============
+// Functions that can never capture a continuation are compiled to C functions
+// that return their value (see Effects in the compiler). Their closures hold a
+// CPS entry like any other, which calls the function and passes the result on
+// to the continuation: ReturnDirect. Direct-style code calls closures with
+// ApplyDirect, which runs CPS callees on a trampoline of their own.
+//
+// The collector cannot see values on the C stack, so a direct-style function
+// that calls others keeps its variables in a KsuFrame on the thread's
+// ksu_frames list, and collects at its entry when a collection is due
+// (ksu_enter), as its loops do at every iteration. The same check turns
+// recursion past ksu_stack_limit into an error instead of a crash.
+typedef Value* (*DirectLambda_t)(ClosureEnv, int, Value**);
+
+typedef struct KsuFrame {
+    struct KsuFrame* prev;
+    Lambda_t caller;    // ksu_current_func of the caller
+    int size;
+    Value*** roots;     // addresses of the variables
+} KsuFrame;
+
+extern _Thread_local KsuFrame* ksu_frames;
+extern _Thread_local char* ksu_stack_limit;  // NULL if unknown
+
+// Collects if a collection is due and fails if the stack is exhausted
+void ksu_safepoint(void);
+
+KSU_INLINE void ksu_enter(KsuFrame* frame, Lambda_t f) {
+    frame->prev = ksu_frames;
+    frame->caller = ksu_current_func;
+    ksu_frames = frame;
+    ksu_current_func = f;
+    if (gc_pending || (uintptr_t)frame < (uintptr_t)ksu_stack_limit) ksu_safepoint();
+}
+
+KSU_INLINE Value* ksu_leave(KsuFrame* frame, Value* result) {
+    ksu_frames = frame->prev;
+    ksu_current_func = frame->caller;
+    return result;
+}
+
+KSU_INLINE Thunk ReturnDirect(DirectLambda_t f, ClosureEnv env, int argc, Value** argv) {
+    Value* k = argv[argc - 1];
+    KsuFrame frame = { .prev = ksu_frames, .caller = ksu_current_func, .size = 1, .roots = (Value**[]){ &k } };
+    ksu_frames = &frame;
+    Value* result = f(env, argc - 1, argv);
+    ksu_frames = frame.prev;
+    return ApplyClosure(k, 1, (Value*[]){ result });
+}
+
+KSU_INLINE Value* CallKnownDirect(DirectLambda_t f, int argc, Value** argv) {
+    KSU_STAT(known_calls);
+    return f(NULL, argc, argv);
+}
+
+Value* ApplyDirect(Value* f, int argc, Value** argv);
+
+// ============ MAIN ============
+// Generated programs pass their top-level code to ksu_main, which runs it
+// after ksu_init on a thread with a KSU_STACK_SIZE stack, for the recursion of
+// direct-style code. Worker threads get stacks of the same size; the memory is
+// only committed as it is used.
+#define KSU_STACK_SIZE ((size_t)1 << 30)
+int ksu_main(void (*program)(void));
+
+// ============ PRIMITIVES ============
+// Generated code calls the __prim_* functions directly and hands the result to
+// the continuation. Their fast paths are inlined at the call site.
+#define IS_HEAP(v, tag) ((v) != NULL && !IS_IMMEDIATE(v) && (v)->t == (tag))
+#define IS_BOOL(v) ((v) == KSU_TRUE || (v) == KSU_FALSE)
+
+// True if v is a box or a box can be reached from it through pairs
+static inline bool contains_box(Value* v) {
+    if (v == NULL || IS_IMMEDIATE(v)) return false;
+    return v->t == BOX || (v->t == PAIR && v->pair.has_box);
+}
+
+// Value to store in a box: the value itself, or a private copy with -DKSU_BOX_COPY
+static inline Value* box_contents(Value* v) {
+#ifdef KSU_BOX_COPY
+    return deep_copy(v);
+#else
+    if (contains_box(v)) runtime_error("please don't create box over box");
+    return v;
+#endif
+}
+
+// ============ PAIR OPERATIONS ============
+KSU_INLINE Value* __prim_fst(Value* v) {
+    if (!IS_HEAP(v, PAIR)) type_error(v, "fst expects a pair");
+    return v->pair.first;
+}
+
+KSU_INLINE Value* __prim_snd(Value* v) {
+    if (!IS_HEAP(v, PAIR)) type_error(v, "snd expects a pair");
+    return v->pair.second;
+}
+
+KSU_INLINE Value* __prim_pair(Value* l, Value* r) {
+    if (l == NULL || r == NULL) type_error2(l, r, "pair expects non-NULL arguments");
+    return MakePair(l, r);
+}
+
+// ============ TYPE PREDICATES ============
+KSU_INLINE Value* __prim_is_pair(Value* v) {
+    if (v == NULL) type_error(v, "pair? expects a value");
+    return MakeBool(value_tag(v) == PAIR);
+}
+
+KSU_INLINE Value* __prim_is_nil(Value* v) {
+    if (v == NULL) type_error(v, "nil? expects a value");
+    return MakeBool(v == KSU_NIL);
+}
+
+KSU_INLINE Value* __prim_is_number(Value* v) {
+    if (v == NULL) type_error(v, "number? expects a value");
+    return MakeBool(IS_FIXNUM(v));
+}
+
+KSU_INLINE Value* __prim_is_symbol(Value* v) {
+    if (v == NULL) type_error(v, "symbol? expects a value");
+    return MakeBool(value_tag(v) == SYMBOL);
+}
+
+KSU_INLINE Value* __prim_is_vector(Value* v) {
+    if (v == NULL) type_error(v, "vector? expects a value");
+    return MakeBool(value_tag(v) == VECTOR);
+}
+
+KSU_INLINE Value* __prim_is_hashtable(Value* v) {
+    if (v == NULL) type_error(v, "hashtable? expects a value");
+    return MakeBool(value_tag(v) == HASHTABLE);
+}
+
+// ============ COMPARISON ============
+KSU_INLINE Value* __prim_eq(Value* a, Value* b) {
+    if (BOTH_FIXNUM(a, b)) return MakeBool(a == b);
+    if (IS_HEAP(a, SYMBOL)) return MakeBool(a == b);
+    return eq_slow(a, b);
+}
+
+KSU_INLINE Value* __prim_ne(Value* a, Value* b) {
+    if (BOTH_FIXNUM(a, b)) return MakeBool(a != b);
+    if (IS_HEAP(a, SYMBOL)) return MakeBool(a != b);
+    return ne_slow(a, b);
+}
+
+KSU_INLINE Value* __prim_lt(Value* a, Value* b) {
+    if (!BOTH_FIXNUM(a, b)) type_error2(a, b, "< expects two integers");
+    return MakeBool(INT_VALUE(a) < INT_VALUE(b));
+}
+
+KSU_INLINE Value* __prim_gt(Value* a, Value* b) {
+    if (!BOTH_FIXNUM(a, b)) type_error2(a, b, "> expects two integers");
+    return MakeBool(INT_VALUE(a) > INT_VALUE(b));
+}
+
+KSU_INLINE Value* __prim_le(Value* a, Value* b) {
+    if (!BOTH_FIXNUM(a, b)) type_error2(a, b, "<= expects two integers");
+    return MakeBool(INT_VALUE(a) <= INT_VALUE(b));
+}
+
+KSU_INLINE Value* __prim_ge(Value* a, Value* b) {
+    if (!BOTH_FIXNUM(a, b)) type_error2(a, b, ">= expects two integers");
+    return MakeBool(INT_VALUE(a) >= INT_VALUE(b));
+}
+
+// ============ ARITHMETIC ============
+KSU_INLINE Value* __prim_add(Value* a, Value* b) {
+    if (!BOTH_FIXNUM(a, b)) type_error2(a, b, "+ expects two integers");
+    return MakeInt(INT_VALUE(a) + INT_VALUE(b));
+}
+
+KSU_INLINE Value* __prim_sub(Value* a, Value* b) {
+    if (!BOTH_FIXNUM(a, b)) type_error2(a, b, "- expects two integers");
+    return MakeInt(INT_VALUE(a) - INT_VALUE(b));
+}
+
+KSU_INLINE Value* __prim_mul(Value* a, Value* b) {
+    if (!BOTH_FIXNUM(a, b)) type_error2(a, b, "* expects two integers");
+    return MakeInt(INT_VALUE(a) * INT_VALUE(b));
+}
+
+KSU_INLINE Value* __prim_div(Value* a, Value* b) {
+    if (!BOTH_FIXNUM(a, b)) type_error2(a, b, "/ expects two integers");
+    if (INT_VALUE(b) == 0) division_by_zero(a);
+    return MakeInt(INT_VALUE(a) / INT_VALUE(b));
+}
+
+// Division of unboxed integers, for operands the compiler has proved to be integers
+KSU_INLINE int __int_div(int a, int b) {
+    if (b == 0) division_by_zero(MakeInt(a));
+    return a / b;
+}
+
+// ============ BOOLEAN OPERATIONS ============
+KSU_INLINE Value* __prim_and(Value* a, Value* b) {
+    if (!IS_BOOL(a) || !IS_BOOL(b)) type_error2(a, b, "and expects two booleans");
+    return MakeBool(BOOL_VALUE(a) && BOOL_VALUE(b));
+}
+
+KSU_INLINE Value* __prim_or(Value* a, Value* b) {
+    if (!IS_BOOL(a) || !IS_BOOL(b)) type_error2(a, b, "or expects two booleans");
+    return MakeBool(BOOL_VALUE(a) || BOOL_VALUE(b));
+}
+
+KSU_INLINE Value* __prim_not(Value* a) {
+    if (!IS_BOOL(a)) type_error(a, "not expects a boolean");
+    return MakeBool(!BOOL_VALUE(a));
+}
+
+// ============ BOX OPERATIONS ============
+// The box slot is read and written atomically, with release/acquire ordering,
+// so a value stored by one thread is seen fully built by the others.
+KSU_INLINE Value* __prim_box(Value* v) {
+    if (v == NULL) type_error(v, "box expects a value");
+    return MakeBox(box_contents(v));
+}
+
+KSU_INLINE Value* __prim_set(Value* box, Value* value) {
+    if (value == NULL || !IS_HEAP(box, BOX)) type_error2(box, value, "set! expects a box and a value");
+    __atomic_store_n(&box->box.ptr, box_contents(value), __ATOMIC_RELEASE);
+    return MakeNil();
+}
+
+KSU_INLINE Value* __prim_unwrap(Value* box) {
+    if (!IS_HEAP(box, BOX)) type_error(box, "unwrap expects a box");
+    Value* v = __atomic_load_n(&box->box.ptr, __ATOMIC_ACQUIRE);
+    if (v == NULL) runtime_error("unwrap: box is empty");
+#ifdef KSU_BOX_COPY
+    return deep_copy(v);
+#else
+    return v;
+#endif
+}
+
+KSU_INLINE Value* __prim_peek(Value* box) {
+    if (!IS_HEAP(box, BOX)) type_error(box, "peek expects a box");
+    return __atomic_load_n(&box->box.ptr, __ATOMIC_ACQUIRE);
+}
+
+// ============ VECTOR OPERATIONS ============
+// Elements are read and written like box contents, see above. The unsigned
+// compare rejects negative indices as well.
+KSU_INLINE Value* __prim_vector_ref(Value* v, Value* i) {
+    if (!IS_HEAP(v, VECTOR) || !IS_FIXNUM(i)) type_error2(v, i, "vector-ref expects a vector and an integer");
+    if ((unsigned)INT_VALUE(i) >= (unsigned)v->vector.length) index_error(v, i);
+    return __atomic_load_n(&v->vector.items[INT_VALUE(i)], __ATOMIC_ACQUIRE);
+}
+
+KSU_INLINE Value* __prim_vector_set(Value* v, Value* i, Value* value) {
+    if (!IS_HEAP(v, VECTOR) || !IS_FIXNUM(i)) type_error2(v, i, "vector-set! expects a vector and an integer");
+    if (value == NULL) type_error(value, "vector-set! expects a value");
+    if ((unsigned)INT_VALUE(i) >= (unsigned)v->vector.length) index_error(v, i);
+    __atomic_store_n(&v->vector.items[INT_VALUE(i)], value, __ATOMIC_RELEASE);
+    return MakeNil();
+}
+
+KSU_INLINE Value* __prim_vector_length(Value* v) {
+    if (!IS_HEAP(v, VECTOR)) type_error(v, "vector-length expects a vector");
+    return MakeInt(v->vector.length);
+}
+
+// ============ HASH TABLE OPERATIONS ============
+KSU_INLINE Value* __prim_hashtable_count(Value* table) {
+    if (!IS_HEAP(table, HASHTABLE)) type_error(table, "hashtable-count expects a hash table");
+    return MakeInt(table->hashtable.count);
+}
+
+#endif // KSU_RUNTIME_H
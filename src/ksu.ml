@@ -3,16 +3,179 @@ open Ksu_parser
 open Compiler
 
 (* Command line argument parsing *)
-let usage_msg = "ksu <file>"
+let usage_msg =
+  "ksu [--cheney] [--stats] <file>\n       ksu build [-O0|-O1|-O2|-O3] [--lto] [--pgo] [--pgo-input <file>] [--cheney] [--stats] [-o <exe>] <file>"
 let input_file = ref None
 
+let speclist =
+  [
+    ( "--cheney",
+      Arg.Set Ksu2c.cheney,
+      " Call functions directly and reset the C stack with longjmp instead of trampolining every call" );
+    ( "--stats",
+      Arg.Set Ksu2c.stats,
+      " Count allocations, calls and bounces; the counters are printed at exit when KSU_STATS is set" );
+  ]
+
+(* ksu build compiles the generated C and links it against libksu.a *)
+let opt_level = ref "-O2"
+let lto = ref false
+let pgo = ref false
+let pgo_input = ref Filename.null
+let output = ref "a.out"
+
+let build_speclist =
+  List.map (fun o -> (o, Arg.Unit (fun () -> opt_level := o), " Optimization level of the C compiler (default -O2)"))
+    [ "-O0"; "-O1"; "-O2"; "-O3" ]
+  @ [
+      ("--lto", Arg.Set lto, " Optimize the program and libksu.a together at link time");
+      ("--pgo", Arg.Set pgo, " Build with profiling, run the program once, then rebuild with the profile");
+      ("--pgo-input", Arg.Set_string pgo_input, "<file> Standard input of the --pgo training run (default /dev/null)");
+      ("-o", Arg.Set_string output, "<exe> Name of the executable (default a.out)");
+    ]
+  @ speclist
+
 let anon_fun filename =
   match !input_file with
   | None -> input_file := Some filename
   | Some _ -> failwith "Error: Only one file can be specified"
 
+let parse file =
+  let lexbuf = Lexing.from_channel (open_in file) in
+  try Lang.Ast.builtin_definitions @ Parser.parse Lexer.lex lexbuf
+  with Parser.Error ->
+    let pos = lexbuf.lex_curr_p in
+    Printf.eprintf ("Parsing error at line %d, column %d, file %s\n") pos.pos_lnum
+      (pos.pos_cnum - pos.pos_bol) file;
+    exit 1
+
+let compile_to_c file ast oc =
+  Ksu2c.source_file := file;
+
+  (* Sanitize variable names for C code generation *)
+  let sanitized_ast = Name_sanitizer.sanitize_top_exprs ast in
+
+  (* Inline, fold constants and drop unused defines *)
+  let optimized_ast = Optimize.optimize sanitized_ast in
+
+  (* Mark the lambdas that can be compiled in direct style *)
+  let marked_ast = Effects.mark optimized_ast in
+
+  (* Write AST to debug file *)
+  let ast_file = "/tmp/" ^ Filename.basename file ^ ".ast" in
+  let oc_ast = open_out ast_file in
+  List.iter (fun e -> output_string oc_ast (Lang.Ast.string_of_top_expr e ^ "\n")) marked_ast;
+  close_out oc_ast;
+
+  (* Do CPS conversion *)
+  let cps_ast = List.map Cps.t_top marked_ast in
+
+  (* Back-translate from CPS to AST *)
+  let from_cps_ast = List.map Cps.from_cps_top cps_ast in
+
+  (* Write CPS-converted AST to debug file *)
+  let cps_ast_file = "/tmp/" ^ Filename.basename file ^ ".cps.ast" in
+  let oc_cps = open_out cps_ast_file in
+  List.iter (fun e -> output_string oc_cps (Lang.Ast.string_of_top_expr e ^ "\n")) from_cps_ast;
+  close_out oc_cps;
+
+  (* Do closure conversion, then turn self tail calls into loops *)
+  let converted_ast = Loops.convert (Closures.convert from_cps_ast) in
+
+  (* Write closure-converted AST to debug file *)
+  let cc_ast_file = "/tmp/" ^ Filename.basename file ^ ".cc.ast" in
+  let oc_cc = open_out cc_ast_file in
+  List.iter (fun e -> output_string oc_cc (Closures.string_of_cc_top_expr e ^ "\n")) converted_ast;
+  close_out oc_cc;
+
+  (* Generate C code *)
+  Ksu2c.ksu2c oc converted_ast
+
+(* Directory with libksu.a and ksu_runtime.h: $KSU_RUNTIME, next to the
+   executable in the dune build tree, or the installed lib/ksu *)
+let runtime_dir () =
+  let exe_dir = Filename.dirname Sys.executable_name in
+  let candidates =
+    Option.to_list (Sys.getenv_opt "KSU_RUNTIME")
+    @ [ Filename.concat exe_dir "Runtime"; List.fold_left Filename.concat exe_dir [ ".."; "lib"; "ksu" ] ]
+  in
+  match List.find_opt (fun d -> Sys.file_exists (Filename.concat d "libksu.a")) candidates with
+  | Some dir -> dir
+  | None ->
+      prerr_endline "Error: libksu.a not found, set KSU_RUNTIME to the directory that contains it";
+      exit 1
+
+exception Command_failed of string
+
+let run ?stdin ?stdout cmd args =
+  let command = Filename.quote_command cmd ?stdin ?stdout args in
+  if Sys.command command <> 0 then raise (Command_failed command)
+
+let temp_dir () =
+  let dir = Filename.temp_file "ksu" ".build" in
+  Sys.remove dir;
+  Sys.mkdir dir 0o700;
+  dir
+
+let rec remove_tree path =
+  if Sys.is_directory path then begin
+    Array.iter (fun f -> remove_tree (Filename.concat path f)) (Sys.readdir path);
+    Sys.rmdir path
+  end
+  else Sys.remove path
+
+let build file =
+  let ast = parse file in
+  let rt = runtime_dir () in
+  let cc = Option.value (Sys.getenv_opt "CC") ~default:"gcc" in
+  let dir = temp_dir () in
+  Fun.protect ~finally:(fun () -> remove_tree dir) @@ fun () ->
+  let c_file = Filename.concat dir (Filename.remove_extension (Filename.basename file) ^ ".c") in
+  let oc = open_out c_file in
+  compile_to_c file ast oc;
+  close_out oc;
+
+  let flags =
+    (!opt_level :: (if !lto then [ "-flto=auto" ] else []))
+    @ (if !Ksu2c.stats then [ "-DKSU_STATS" ] else [])
+    @ [ "-I"; rt; "-pthread" ]
+  in
+  let sources = [ c_file; Filename.concat rt "ksu_runtime.c"; Filename.concat rt "ksu_builtins.c" ] in
+  if not !pgo then begin
+    (* libksu.a is built without counters, so stats builds compile the runtime *)
+    if !Ksu2c.stats then run cc (flags @ sources @ [ "-o"; !output ])
+    else run cc (flags @ [ c_file; Filename.concat rt "libksu.a"; "-o"; !output ])
+  end
+  else begin
+    (* The runtime is compiled from source as well, so that it gets optimized
+       for the program too. Objects keep their paths between the two passes,
+       which is how gcc matches them with their profiles. *)
+    let objects = List.mapi (fun i _ -> Filename.concat dir (Printf.sprintf "%d.o" i)) sources in
+    let profile = Filename.concat dir "profile" in
+    let compile_and_link extra =
+      List.iter2 (fun src obj -> run cc (flags @ extra @ [ "-c"; src; "-o"; obj ])) sources objects;
+      run cc (flags @ extra @ objects @ [ "-o"; !output ])
+    in
+    compile_and_link [ "-fprofile-generate=" ^ profile ];
+    let exe = if Filename.is_implicit !output then Filename.concat Filename.current_dir_name !output else !output in
+    (* The training run reads --pgo-input, never whatever stdin ksu got *)
+    run ~stdin:!pgo_input ~stdout:Filename.null exe [];
+    compile_and_link [ "-fprofile-use=" ^ profile; "-Wno-missing-profile" ]
+  end
+
 let () =
-  Arg.parse [] anon_fun usage_msg;
+  let build_mode = Array.length Sys.argv > 1 && Sys.argv.(1) = "build" in
+  (try
+     if build_mode then
+       Arg.parse_argv (Array.sub Sys.argv 1 (Array.length Sys.argv - 1)) build_speclist anon_fun usage_msg
+     else Arg.parse_argv Sys.argv speclist anon_fun usage_msg
+   with
+   | Arg.Bad msg ->
+       prerr_string msg;
+       exit 2
+   | Arg.Help msg ->
+       print_string msg;
+       exit 0);
 
   (* Check that exactly one file was provided *)
   match !input_file with
@@ -20,50 +183,10 @@ let () =
       print_endline "Error: No file specified";
       print_endline usage_msg;
       exit 1
-  | Some file ->
-      (* Parse the file *)
-      let lexbuf = Lexing.from_channel (open_in file) in
-      let ast =
-        try Lang.Ast.builtin_definitions @ Parser.parse Lexer.lex lexbuf
-        with Parser.Error ->
-          let pos = lexbuf.lex_curr_p in
-          Printf.eprintf ("Parsing error at line %d, column %d, file %s\n") pos.pos_lnum
-            (pos.pos_cnum - pos.pos_bol) file;
-          exit 1
-      in
-
-      (* Sanitize variable names for C code generation *)
-      let sanitized_ast = Name_sanitizer.sanitize_top_exprs ast in
-
-      (* Write AST to debug file *)
-      let ast_file = "/tmp/" ^ Filename.basename file ^ ".ast" in
-      let oc = open_out ast_file in
-      List.iter (fun e -> output_string oc (Lang.Ast.string_of_top_expr e ^ "\n")) sanitized_ast;
-      close_out oc;
-
-      (* Do CPS conversion *)
-      let cps_ast = List.map Cps.t_top sanitized_ast in
-
-      (* Back-translate from CPS to AST *)
-      let from_cps_ast = List.map Cps.from_cps_top cps_ast in
-
-      (* Write CPS-converted AST to debug file *)
-      let cps_ast_file = "/tmp/" ^ Filename.basename file ^ ".cps.ast" in
-      let oc = open_out cps_ast_file in
-      List.iter (fun e -> output_string oc (Lang.Ast.string_of_top_expr e ^ "\n")) from_cps_ast;
-      close_out oc;
-
-      (* Do closure conversion *)
-      let converted_ast = Closures.convert from_cps_ast in
-
-      (* Write closure-converted AST to debug file *)
-      let cc_ast_file = "/tmp/" ^ Filename.basename file ^ ".cc.ast" in
-      let oc = open_out cc_ast_file in
-      List.iter (fun e -> output_string oc (Closures.string_of_cc_top_expr e ^ "\n")) converted_ast;
-      close_out oc;
-
-      (* Generate C code *)
-      let c_text = Ksu2c.ksu2c converted_ast in
-
-      (* Print the result *)
-      print_endline c_text
+  | Some file -> (
+      if not build_mode then compile_to_c file (parse file) stdout
+      else
+        try build file
+        with Command_failed command ->
+          Printf.eprintf "Error: command failed: %s\n" command;
+          exit 1)
@@ -41,35 +41,43 @@ FAILED_MESSAGES = [
 PROJECT_ROOT = Path(__file__).parent.parent
 KSU_BIN = PROJECT_ROOT / '_build' / 'default' / 'src' / 'ksu.exe'
 
-def run_ksu_file(file_path):
+# Every test runs once per mode, built with these extra ksu build flags, and
+# must give the same output in each
+MODES = [
+    ('default', []),
+    ('cheney', ['--cheney']),
+]
+
+# Tests in this directory are built with the runtime counters and run with
+# KSU_STATS=1; besides their output, they must print the counters on stderr
+STATS_DIR = 'test/stats'
+
+def run_ksu_file(file_path, flags=()):
     """Compile and run a single .ksu file, return stdout or error string."""
     try:
-        gen = subprocess.run(
-            [str(KSU_BIN), str(file_path)],
-            capture_output=True, text=True, cwd=PROJECT_ROOT
-        )
-        if gen.returncode != 0:
-            return f"ERROR: {gen.stderr.strip()}"
-
         import tempfile
         with tempfile.TemporaryDirectory() as td:
-            c_path = Path(td) / 'test.c'
             exe_path = Path(td) / 'a.out'
-            c_path.write_text(gen.stdout)
+            stats = str(file_path).startswith(STATS_DIR)
+            if stats:
+                flags = [*flags, '--stats']
 
-            runtime_c = PROJECT_ROOT / 'src' / 'Runtime' / 'ksu_runtime.c'
-            runtime_include = PROJECT_ROOT / 'src' / 'Runtime'
-
-            comp = subprocess.run(
-                ['gcc', str(c_path), str(runtime_c), '-I', str(runtime_include), '-o', str(exe_path)],
-                capture_output=True, text=True,
+            build = subprocess.run(
+                [str(KSU_BIN), 'build', *flags, '-o', str(exe_path), str(file_path)],
+                capture_output=True, text=True, cwd=PROJECT_ROOT
             )
-            if comp.returncode != 0:
-                return f"ERROR: C compile failed: {comp.stderr.strip()}"
-
-            run = subprocess.run([str(exe_path)], capture_output=True, text=True)
+            if build.returncode != 0:
+                return f"ERROR: {build.stderr.strip()}"
+
+            # A test reads its .in file as stdin, if it has one
+            input_path = Path(file_path).with_suffix('.in')
+            with open(input_path) if input_path.exists() else open(os.devnull) as stdin:
+                env = dict(os.environ, KSU_STATS='1') if stats else None
+                run = subprocess.run([str(exe_path)], stdin=stdin, capture_output=True, text=True, env=env)
             if run.returncode != 0:
                 return f"ERROR: Program exited with {run.returncode}: {run.stderr.strip()}"
+            if stats and not re.search(r'^ksu-stats: \w+=\d+$', run.stderr, re.MULTILINE):
+                return f"ERROR: no ksu-stats counters on stderr: {run.stderr.strip()}"
             return run.stdout.strip()
 
     except subprocess.CalledProcessError as e:
@@ -77,16 +85,16 @@ def run_ksu_file(file_path):
     except FileNotFoundError as e:
         return f"ERROR: command not found: {e}"
 
-def run_single_test(file_path):
-    """Run one test, return (file_path, passed, error_msg)."""
+def run_single_test(file_path, mode, flags):
+    """Run one test, return (file_path, mode, passed, error_msg)."""
     try:
         expected = extract_expected_result(file_path)
-        actual = run_ksu_file(file_path)
+        actual = run_ksu_file(file_path, flags)
         if actual == expected:
-            return (file_path, True, None)
-        return (file_path, False, f"expected: {expected!r}, got: {actual!r}")
+            return (file_path, mode, True, None)
+        return (file_path, mode, False, f"expected: {expected!r}, got: {actual!r}")
     except Exception as e:
-        return (file_path, False, str(e))
+        return (file_path, mode, False, str(e))
 
 def run_tests():
     # Build ksu first
@@ -98,7 +106,7 @@ def run_tests():
 
     test_dirs = [
         'test/callcc', 'test/generic', 'test/lists',
-        'test/closures', 'test/state', 'test/quote', 'test/errors',
+        'test/closures', 'test/state', 'test/quote', 'test/errors', 'test/tasks', 'test/futures', 'test/vectors', 'test/hashtables', 'test/direct', 'test/optimize', 'test/types', 'test/io', 'test/stats',
     ]
 
     # Collect all test files
@@ -115,30 +123,31 @@ def run_tests():
     results = {}
     workers = min(8, os.cpu_count() or 4)
     with ThreadPoolExecutor(max_workers=workers) as executor:
-        futures = {executor.submit(run_single_test, fp): fp for fp in all_tests}
+        futures = [executor.submit(run_single_test, fp, mode, flags) for mode, flags in MODES for fp in all_tests]
         for future in as_completed(futures):
-            fp, passed, err = future.result()
-            results[fp] = (passed, err)
+            fp, mode, passed, err = future.result()
+            results[fp, mode] = (passed, err)
 
-    # Print grouped by directory
+    # Print grouped by mode and directory
     passed_tests = 0
     failed_tests = []
-    for test_dir in test_dirs:
-        dir_tests = [fp for fp in all_tests if str(fp).startswith(test_dir)]
-        if not dir_tests:
-            continue
-        print(f"\nTesting {test_dir}:")
-        print("-" * 30)
-        for fp in sorted(dir_tests):
-            passed, err = results[fp]
-            if passed:
-                print(f"  PASS {fp.name}")
-                passed_tests += 1
-            else:
-                print(red(f"  FAIL {fp.name}"))
-                failed_tests.append((fp.name, err))
-
-    total = len(all_tests)
+    for mode, _ in MODES:
+        for test_dir in test_dirs:
+            dir_tests = [fp for fp in all_tests if str(fp).startswith(test_dir)]
+            if not dir_tests:
+                continue
+            print(f"\nTesting {test_dir} ({mode}):")
+            print("-" * 30)
+            for fp in sorted(dir_tests):
+                passed, err = results[fp, mode]
+                if passed:
+                    print(f"  PASS {fp.name}")
+                    passed_tests += 1
+                else:
+                    print(red(f"  FAIL {fp.name}"))
+                    failed_tests.append((f"{fp.name} ({mode})", err))
+
+    total = len(all_tests) * len(MODES)
     color = green if passed_tests == total else red
     print(f"\n{color(f'Test Results: {passed_tests}/{total} passed')}")
 